@@ -0,0 +1,286 @@
+using namespace std;
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <sys/resource.h>
+#include "petrinet.h"
+
+// Throughput benchmark over generated nets, see README.md. Usage:
+//
+//     pnbench <net> <size> <mt|mtbatch|mtaffinity|st> [firings]
+//
+// mtbatch is MTPetriNet with batched firing (see setBatchFiring), mtaffinity
+// with transitions partitioned over the workers (see setAffinity).
+// Every net is bounded by private fuel places, so a run ends (the net gets
+// dead) after about the given number of firings. Prints a CSV row prefixed
+// with "pnbench," (columns as printed by pnbench --header).
+
+#if defined( PN_ATOMIC_TOKENS )
+const string mode = "atomic";
+#elif defined( SIMU_MODE_RANDOMPICK )
+const string mode = "randompick";
+#elif defined( SIMU_MODE_RANDOMPRIO )
+const string mode = "randomprio";
+#elif defined( SIMU_MODE_STPN )
+const string mode = "stpn";
+#else
+const string mode = "default";
+#endif
+
+const vector<string> statnames = {"steals","parks","lockwaits","casretries","failedtriggers"};
+
+// Per thread firing count and latency samples. The latency of a firing is the
+// time since the previous firing on the same thread, i.e. the cost of a
+// firing including the engine overheads.
+class ThreadStats
+{
+public:
+    static const unsigned MAXSAMPLES = 1 << 20;
+    unsigned long _firings = 0;
+    vector<unsigned> _lat;
+    chrono::steady_clock::time_point _last;
+};
+mutex allstatsmutex;
+vector<unique_ptr<ThreadStats>> allstats;
+thread_local ThreadStats *tlstats = nullptr;
+
+void onFire(unsigned long)
+{
+    auto now = chrono::steady_clock::now();
+    if ( not tlstats )
+    {
+        const lock_guard<mutex> lock(allstatsmutex);
+        allstats.emplace_back(new ThreadStats());
+        tlstats = allstats.back().get();
+        tlstats->_lat.reserve(ThreadStats::MAXSAMPLES);
+    }
+    if ( tlstats->_firings++ and tlstats->_lat.size() < ThreadStats::MAXSAMPLES )
+        tlstats->_lat.push_back(chrono::duration_cast<chrono::nanoseconds>(now - tlstats->_last).count());
+    tlstats->_last = now;
+}
+
+class NetGen
+{
+    PetriNetBase& _pn;
+    unsigned long _firings;
+    mt19937 _rng {12345}; // fixed, so that random nets are the same across runs
+    PNPlace* place(string name, unsigned marking=0) { return _pn.createPlace(name, marking, 0); }
+    PNTransition* transition(string name)
+    {
+        auto t = _pn.createTransition(name);
+        t->setEnabledActions(onFire);
+        return t;
+    }
+    // Private fuel place bounding the firings of t
+    void fuel(PNTransition *t, unsigned long n)
+    {
+        _pn.createArc(place(t->_name + "_fuel", n), t);
+    }
+public:
+    // Philosophers pick both forks at once, so the net doesn't deadlock
+    void philosophers(unsigned n)
+    {
+        vector<PNPlace*> forks;
+        for(unsigned i=0; i<n; i++) forks.push_back(place("fork" + to_string(i), 1));
+        for(unsigned i=0; i<n; i++)
+        {
+            string id = to_string(i);
+            auto eat = transition("eat" + id), think = transition("think" + id);
+            auto eating = place("eating" + id);
+            auto lfork = forks[i], rfork = forks[(i+1)%n];
+            _pn.createArc(lfork, eat);
+            _pn.createArc(rfork, eat);
+            _pn.createArc(eat, eating);
+            _pn.createArc(eating, think);
+            _pn.createArc(think, lfork);
+            _pn.createArc(think, rfork);
+            fuel(eat, _firings / (2*n));
+        }
+    }
+    // n places in a ring with n/4 tokens circulating
+    void ring(unsigned n)
+    {
+        vector<PNPlace*> ps;
+        for(unsigned i=0; i<n; i++) ps.push_back(place("p" + to_string(i), i % 4 == 0));
+        for(unsigned i=0; i<n; i++)
+        {
+            auto t = transition("t" + to_string(i));
+            _pn.createArc(ps[i], t);
+            _pn.createArc(t, ps[(i+1)%n]);
+            fuel(t, _firings / n);
+        }
+    }
+    // Binary fork tree of given depth whose leaves are joined back by a
+    // mirror tree, a token at the root goes through all of it per round
+    void forkjoin(unsigned depth)
+    {
+        unsigned nforks = (1 << depth) - 1;
+        vector<PNPlace*> down, up;
+        for(unsigned i=0; i<2*nforks+1; i++)
+        {
+            down.push_back(place("down" + to_string(i)));
+            up.push_back(place("up" + to_string(i)));
+        }
+        auto src = place("src", 1);
+        auto start = transition("start"), done = transition("done");
+        _pn.createArc(src, start);
+        _pn.createArc(start, down[0]);
+        _pn.createArc(up[0], done);
+        _pn.createArc(done, src);
+        fuel(start, _firings / (3*nforks + 3));
+        for(unsigned i=0; i<nforks; i++)
+        {
+            string id = to_string(i);
+            auto fork = transition("fork" + id), join = transition("join" + id);
+            _pn.createArc(down[i], fork);
+            _pn.createArc(fork, down[2*i+1]);
+            _pn.createArc(fork, down[2*i+2]);
+            _pn.createArc(up[2*i+1], join);
+            _pn.createArc(up[2*i+2], join);
+            _pn.createArc(join, up[i]);
+        }
+        for(unsigned i=nforks; i<2*nforks+1; i++)
+        {
+            auto leaf = transition("leaf" + to_string(i));
+            _pn.createArc(down[i], leaf);
+            _pn.createArc(leaf, up[i]);
+        }
+    }
+    // n producers and n consumers sharing (n+3)/4 buffers of 4 slots each
+    void prodcons(unsigned n)
+    {
+        unsigned nbufs = (n+3) / 4;
+        vector<PNPlace*> slots, full;
+        for(unsigned i=0; i<nbufs; i++)
+        {
+            slots.push_back(place("slots" + to_string(i), 4));
+            full.push_back(place("full" + to_string(i)));
+        }
+        for(unsigned i=0; i<n; i++)
+        {
+            string id = to_string(i);
+            auto produce = transition("produce" + id), consume = transition("consume" + id);
+            _pn.createArc(slots[i%nbufs], produce);
+            _pn.createArc(produce, full[i%nbufs]);
+            _pn.createArc(full[i%nbufs], consume);
+            _pn.createArc(consume, slots[i%nbufs]);
+            fuel(produce, _firings / (2*n));
+        }
+    }
+    // A chain of n transitions that firings/n tokens, all in the first place
+    // to begin with, flow through, i.e. places holding many tokens
+    void pipeline(unsigned n)
+    {
+        vector<PNPlace*> ps;
+        for(unsigned i=0; i<=n; i++) ps.push_back(place("p" + to_string(i), i ? 0 : _firings / n));
+        for(unsigned i=0; i<n; i++)
+        {
+            auto t = transition("t" + to_string(i));
+            _pn.createArc(ps[i], t);
+            _pn.createArc(t, ps[i+1]);
+        }
+    }
+    // n places each with 4 conflicting consumer transitions that move a token
+    // to a random place. Every place also has 4 producers (the targets are a
+    // random permutation), so that tokens spread evenly rather than piling up
+    // on places whose fuel runs out early, which would end the run short.
+    void random(unsigned n)
+    {
+        vector<PNPlace*> ps;
+        for(unsigned i=0; i<n; i++) ps.push_back(place("p" + to_string(i), 1 + _rng() % 3));
+        vector<unsigned> targets(4*n);
+        for(unsigned i=0; i<4*n; i++) targets[i] = i % n;
+        shuffle(targets.begin(), targets.end(), _rng);
+        for(unsigned i=0; i<4*n; i++)
+        {
+            auto t = transition("t" + to_string(i));
+            _pn.createArc(ps[i%n], t);
+            _pn.createArc(t, ps[targets[i]]);
+            fuel(t, _firings / (4*n));
+        }
+    }
+    NetGen(PetriNetBase& pn, unsigned long firings) : _pn(pn), _firings(firings) {}
+};
+
+void usage()
+{
+    cout << "Usage: pnbench <philosophers|ring|forkjoin|prodcons|pipeline|random> <size> <mt|mtbatch|mtaffinity|st> [firings]" << endl;
+    cout << "       pnbench --header" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    if ( argc == 2 and string(argv[1]) == "--header" )
+    {
+        cout << "mode,engine,net,size,nthreads,firings,secs,firings_per_sec,"
+             << "lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_max_ns,peak_rss_kb";
+        for(auto& s:statnames) cout << "," << s;
+        cout << endl;
+        return 0;
+    }
+    if ( argc < 4 ) usage();
+    string net = argv[1], engine = argv[3];
+    unsigned size = stoul(argv[2]);
+    unsigned long firings = argc > 4 ? stoul(argv[4]) : 1000000;
+
+    PetriNetBase *pn;
+    if ( engine == "mt" ) pn = new MTPetriNet(net);
+    else if ( engine == "mtbatch" )
+    {
+        auto mt = new MTPetriNet(net);
+        mt->setBatchFiring();
+        pn = mt;
+    }
+    else if ( engine == "mtaffinity" )
+    {
+        auto mt = new MTPetriNet(net);
+        mt->setAffinity();
+        pn = mt;
+    }
+    else if ( engine == "st" ) pn = new STPetriNet(net);
+    else usage();
+    NetGen gen(*pn, firings);
+    if ( net == "philosophers" ) gen.philosophers(size);
+    else if ( net == "ring" ) gen.ring(size);
+    else if ( net == "forkjoin" ) gen.forkjoin(size);
+    else if ( net == "prodcons" ) gen.prodcons(size);
+    else if ( net == "pipeline" ) gen.pipeline(size);
+    else if ( net == "random" ) gen.random(size);
+    else usage();
+
+    auto start = chrono::steady_clock::now();
+    pn->init();
+    pn->wait();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    unsigned long fired = 0;
+    vector<unsigned> lat;
+    for(auto& s:allstats)
+    {
+        fired += s->_firings;
+        lat.insert(lat.end(), s->_lat.begin(), s->_lat.end());
+    }
+    sort(lat.begin(), lat.end());
+    auto percentile = [&](double q) { return lat.empty() ? 0 : lat[ (unsigned long)(q * (lat.size()-1)) ]; };
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char *nthreadsvar = getenv("NTHREADS");
+
+    cout << "pnbench," << mode << "," << engine << "," << net << "," << size << ","
+         << (nthreadsvar ? nthreadsvar : "1") << "," << fired << "," << secs << "," << (unsigned long)(fired / secs) << ","
+         << percentile(0.5) << "," << percentile(0.9) << "," << percentile(0.99) << "," << percentile(1) << ","
+         << usage.ru_maxrss;
+    auto stats = pn->stats();
+    for(auto& name:statnames)
+    {
+        auto s = find_if(stats.begin(), stats.end(), [&](auto& s) { return s.first == name; });
+        cout << "," << ( s == stats.end() ? 0 : s->second );
+    }
+    cout << endl;
+    return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs pnbench over the nets, engines and thread counts below (each can be
+# overridden from the environment) and prints the results as CSV on stdout
+
+NETS=${NETS:-"philosophers:64 ring:256 forkjoin:8 prodcons:16 pipeline:16 random:1000"}
+THREADS=${THREADS:-"1 2 4 8"}
+FIRINGS=${FIRINGS:-1000000}
+# binary:engine pairs, STPetriNet modes are compile time flags hence binaries
+RUNS=${RUNS:-"default:mt atomic:mt default:mtbatch atomic:mtbatch default:mtaffinity atomic:mtaffinity default:st randompick:st randomprio:st stpn:st"}
+
+cd `dirname $0`
+./pnbench_default --header
+for run in $RUNS
+do
+    bin=pnbench_${run%:*}
+    engine=${run#*:}
+    for net in $NETS
+    do
+        for n in $THREADS
+        do
+            PNSEED=1 NTHREADS=$n ./$bin ${net%:*} ${net#*:} $engine $FIRINGS | grep '^pnbench,' | cut -d, -f2-
+        done
+    done
+done
@@ -0,0 +1,96 @@
+using namespace std;
+
+#if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_STPN )
+#   error "pntest_batch replays replicas on STPetriNet in SIMU_MODE_RANDOMPRIO"
+#endif
+#ifndef SIMU_MODE_RANDOMPRIO
+#   define SIMU_MODE_RANDOMPRIO
+#endif
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include "pnbatch.h"
+
+// Randomized deadlock hunt on the dining philosophers net of pntest_dine, by
+// running many seeded replicas over threads (see NTHREADS). The first
+// deadlock found is then replayed twice by STPetriNet with its seed, over
+// several threads, which must fire the same transitions in the same order.
+
+struct Diners
+{
+    STPetriNet _pn;
+    Diners(int nDiners, function<void(unsigned)> fired = [](unsigned) {})
+    {
+        vector<PNPlace*> have_lfork, eating, thinking, free_fork;
+        vector<PNTransition*> take_lfork, strt_eating, strt_thinking;
+        for(int i=0; i<nDiners; i++)
+        {
+            string id = to_string(i);
+            have_lfork.push_back(_pn.createPlace("have_lfork"+id));
+            eating.push_back(_pn.createPlace("eating"+id));
+            thinking.push_back(_pn.createPlace("thinking"+id,1));
+            free_fork.push_back(_pn.createPlace("free_fork"+id,1));
+            take_lfork.push_back(_pn.createTransition("take_lfork"+id));
+            strt_eating.push_back(_pn.createTransition("strt_eating"+id));
+            strt_thinking.push_back(_pn.createTransition("strt_thinking"+id));
+
+            _pn.createArc(thinking[i],take_lfork[i]);
+            _pn.createArc(free_fork[i],take_lfork[i]);
+            _pn.createArc(take_lfork[i],have_lfork[i]);
+            _pn.createArc(have_lfork[i],strt_eating[i]);
+            _pn.createArc(strt_eating[i],eating[i]);
+            _pn.createArc(eating[i],strt_thinking[i]);
+            _pn.createArc(strt_thinking[i],thinking[i]);
+            _pn.createArc(strt_thinking[i],free_fork[i]);
+        }
+        for(int i=0; i<nDiners; i++)
+        {
+            int prev = i ? i-1 : nDiners-1;
+            _pn.createArc(free_fork[i],strt_eating[prev]);
+            _pn.createArc(strt_thinking[prev],free_fork[i]);
+        }
+        for(auto ts:{&take_lfork, &strt_eating, &strt_thinking})
+            for(auto t:*ts) t->setEnabledActions([=](unsigned long) { fired(t->_idx); });
+    }
+    ~Diners() { _pn.deleteElems(); }
+};
+
+// Firing sequence of an STPetriNet run with the given seed
+vector<unsigned> replay(int nDiners, unsigned long seed)
+{
+    vector<unsigned> seq;
+    Diners diners(nDiners, [&](unsigned t) { seq.push_back(t); });
+    diners._pn.setSeed(seed);
+    diners._pn.init();
+    diners._pn.wait();
+    return seq;
+}
+
+int main()
+{
+    const int nDiners = 5;
+    // Replays over several threads unless told otherwise
+    setenv("NTHREADS", "4", 0);
+    Diners diners(nDiners);
+    STPetriNetBatch batch(diners._pn);
+    auto& results = batch.run(1000, 42, 10000);
+    unsigned dead = 0;
+    PNRunResult first;
+    for(auto& r:results)
+        if ( r._status == PNRunResult::DEAD )
+        {
+            if ( dead++ == 0 )
+            {
+                first = r;
+                cout << "First deadlock after " << r._firings << " firings, seed " << r._seed << endl;
+            }
+        }
+    cout << "Deadlocked in " << dead << " of " << results.size() << " runs" << endl;
+    if ( dead == 0 ) return 0;
+
+    auto seq = replay(nDiners, first._seed), again = replay(nDiners, first._seed);
+    bool ok = seq == again and seq.size() == first._firings;
+    cout << "Replayed " << seq.size() << " firings of seed " << first._seed << " twice, "
+         << ( ok ? "same as the replica" : "differing" ) << endl;
+    return ok ? 0 : 1;
+}
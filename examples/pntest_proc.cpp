@@ -0,0 +1,66 @@
+using namespace std;
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include "pnproc.h"
+
+// Dining philosophers run by several processes (see NPROCS), each eating a
+// given number of times. Forks of neighbours in different partitions are
+// boundary places, taken by reserving them from the process owning them.
+// The net is run a second time from an image, without the parent holding it.
+
+int main(int argc, char *argv[])
+{
+    const unsigned nDiners = argc > 1 ? stoul(argv[1]) : 64;
+    const unsigned nMeals = argc > 2 ? stoul(argv[2]) : 1000;
+    STPetriNet pn;
+    vector<PNPlace*> thinking, eating, fork, fuel;
+    vector<PNTransition*> strt_eating, strt_thinking;
+    for(unsigned i=0; i<nDiners; i++)
+    {
+        string id = to_string(i);
+        thinking.push_back(pn.createPlace("thinking"+id,1));
+        eating.push_back(pn.createPlace("eating"+id));
+        fork.push_back(pn.createPlace("fork"+id,1));
+        fuel.push_back(pn.createPlace("fuel"+id,nMeals,0));
+        strt_eating.push_back(pn.createTransition("strt_eating"+id));
+        strt_thinking.push_back(pn.createTransition("strt_thinking"+id));
+    }
+    for(unsigned i=0; i<nDiners; i++)
+    {
+        unsigned next = ( i + 1 ) % nDiners;
+        pn.createArc(thinking[i],strt_eating[i]);
+        pn.createArc(fuel[i],strt_eating[i]);
+        pn.createArc(fork[i],strt_eating[i]);
+        pn.createArc(fork[next],strt_eating[i]);
+        pn.createArc(strt_eating[i],eating[i]);
+        pn.createArc(eating[i],strt_thinking[i]);
+        pn.createArc(strt_thinking[i],thinking[i]);
+        pn.createArc(strt_thinking[i],fork[i]);
+        pn.createArc(strt_thinking[i],fork[next]);
+    }
+
+    auto check = [&](PNProcResult result)
+    {
+        result.print(cout);
+        bool ok = result._status == PNProcResult::DEAD and result._firings == 2UL * nDiners * nMeals;
+        for(unsigned i=0; i<nDiners; i++)
+            ok = ok and result._marking[fork[i]->_idx] == 1 and result._marking[thinking[i]->_idx] == 1
+                    and result._marking[fuel[i]->_idx] == 0;
+        cout << ( ok ? "All meals eaten, forks back on the table" : "Unexpected end state" ) << endl;
+        return ok;
+    };
+    PNProcSim sim(pn);
+    bool ok = check(sim.run());
+    // Again from an image of the net, which the processes map
+    string image = "pntest_proc.img";
+    pn.saveImage(image);
+    {
+        PNProcSim imagesim(image);
+        ok = check(imagesim.run()) and ok;
+    }
+    remove(image.c_str());
+    pn.deleteElems();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,53 @@
+using namespace std;
+
+#include <string>
+#include <vector>
+#include "pnreach.h"
+
+// Exhaustive deadlock search on the dining philosophers net of pntest_dine,
+// compare with the randomized hunt of pntest_batch. Prints the shortest
+// firing sequence into the deadlock, then checks again with stubborn set
+// reduction, which finds the same deadlock over far fewer states.
+
+int main()
+{
+    const int nDiners = 5;
+    STPetriNet pn("dine");
+    vector<PNPlace*> have_lfork, eating, thinking, free_fork;
+    vector<PNTransition*> take_lfork, strt_eating, strt_thinking;
+    for(int i=0; i<nDiners; i++)
+    {
+        string id = to_string(i);
+        have_lfork.push_back(pn.createPlace("have_lfork"+id));
+        eating.push_back(pn.createPlace("eating"+id));
+        thinking.push_back(pn.createPlace("thinking"+id,1));
+        free_fork.push_back(pn.createPlace("free_fork"+id,1));
+        take_lfork.push_back(pn.createTransition("take_lfork"+id));
+        strt_eating.push_back(pn.createTransition("strt_eating"+id));
+        strt_thinking.push_back(pn.createTransition("strt_thinking"+id));
+
+        pn.createArc(thinking[i],take_lfork[i]);
+        pn.createArc(free_fork[i],take_lfork[i]);
+        pn.createArc(take_lfork[i],have_lfork[i]);
+        pn.createArc(have_lfork[i],strt_eating[i]);
+        pn.createArc(strt_eating[i],eating[i]);
+        pn.createArc(eating[i],strt_thinking[i]);
+        pn.createArc(strt_thinking[i],thinking[i]);
+        pn.createArc(strt_thinking[i],free_fork[i]);
+    }
+    for(int i=0; i<nDiners; i++)
+    {
+        int prev = i ? i-1 : nDiners-1;
+        pn.createArc(free_fork[i],strt_eating[prev]);
+        pn.createArc(strt_thinking[prev],free_fork[i]);
+    }
+
+    PNReachability reach(pn);
+    auto r = reach.explore(UINT32_MAX, false);
+    reach.printResult(r);
+    PNReachability reduced(pn);
+    reduced.setReduction(true);
+    auto rr = reduced.explore(UINT32_MAX, false);
+    reduced.printResult(rr);
+    pn.deleteElems();
+}
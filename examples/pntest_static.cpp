@@ -0,0 +1,47 @@
+using namespace std;
+
+#include "pnstatic.h"
+
+// The mutex net of pntest_mutex described at compile time, run by the
+// static engine for a million uses of the resource. As transitions fire in
+// index order, car 1 keeps the resource to itself.
+
+constexpr auto mutexnet = makeStaticNet(
+    {{"at1"}, {"use1"}, {"done1"}, {"drive1",2},
+     {"at2"}, {"use2"}, {"done2"}, {"drive2",2},
+     {"mutex",1}},
+    {{"toat1"}, {"touse1"}, {"todone1"}, {"todrive1"},
+     {"toat2"}, {"touse2"}, {"todone2"}, {"todrive2"}},
+    {{"at1","touse1"}, {"use1","todone1"}, {"done1","todrive1"}, {"drive1","toat1"},
+     {"toat1","at1"}, {"touse1","use1"}, {"todone1","done1"}, {"todrive1","drive1"},
+     {"at2","touse2"}, {"use2","todone2"}, {"done2","todrive2"}, {"drive2","toat2"},
+     {"toat2","at2"}, {"touse2","use2"}, {"todone2","done2"}, {"todrive2","drive2"},
+     {"mutex","touse1"}, {"todone1","mutex"}, {"mutex","touse2"}, {"todone2","mutex"}});
+
+class MutexActions : public PNStaticNoActions
+{
+public:
+    unsigned long _uses[2] = {0, 0};
+    template<unsigned T, typename E> void fired(E& e, unsigned long)
+    {
+        constexpr unsigned use1 = mutexnet.place("use1"), use2 = mutexnet.place("use2");
+        if constexpr ( T == mutexnet.transition("touse1") ) _uses[0]++;
+        if constexpr ( T == mutexnet.transition("touse2") ) _uses[1]++;
+        if ( e.tokens(use1) + e.tokens(use2) > 1 )
+        {
+            cout << "Mutual exclusion violated" << endl;
+            exit(1);
+        }
+        if ( _uses[0] + _uses[1] == 1000000 ) e.quit();
+    }
+};
+
+int main()
+{
+    MutexActions actions;
+    PNStaticEngine<mutexnet, MutexActions> engine(actions);
+    engine.printdot();
+    auto fired = engine.run();
+    cout << "Fired " << fired << " transitions, uses " << actions._uses[0] << " and " << actions._uses[1] << endl;
+    engine.printMarkings();
+}
@@ -0,0 +1,91 @@
+using namespace std;
+
+#if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_RANDOMPRIO )
+#   error "pntest_timewarp compares against STPetriNet in SIMU_MODE_STPN"
+#endif
+#ifndef SIMU_MODE_STPN
+#   define SIMU_MODE_STPN
+#endif
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "pntimewarp.h"
+
+// Closed ring of single server stations, customers going round it, with
+// fixed (and often equal) setup and service times. Each server serves a given
+// number of customers. The ring is simulated by STPetriNet and by PNTimeWarp
+// over NTHREADS logical processes, which must fire the same transitions in
+// the same order.
+
+struct Ring
+{
+    STPetriNet _pn;
+    vector<PNPlace*> _q;
+    Ring(unsigned nStations, unsigned nCustomers, unsigned nServed, function<void(unsigned)> fired)
+    {
+        vector<PNPlace*> idle, busy, fuel;
+        vector<PNTransition*> start, done;
+        for(unsigned i=0; i<nStations; i++)
+        {
+            string id = to_string(i);
+            _q.push_back(_pn.createPlace("q"+id, nCustomers));
+            idle.push_back(_pn.createPlace("idle"+id, 1));
+            busy.push_back(_pn.createPlace("busy"+id));
+            fuel.push_back(_pn.createPlace("fuel"+id, nServed, 0));
+            start.push_back(_pn.createTransition("start"+id));
+            done.push_back(_pn.createTransition("done"+id));
+        }
+        for(unsigned i=0; i<nStations; i++)
+        {
+            unsigned next = ( i + 1 ) % nStations;
+            _pn.createArc(_q[i],start[i]);
+            _pn.createArc(idle[i],start[i]);
+            _pn.createArc(fuel[i],start[i]);
+            _pn.createArc(start[i],busy[i]);
+            _pn.createArc(busy[i],done[i]);
+            _pn.createArc(done[i],idle[i]);
+            _pn.createArc(done[i],_q[next]);
+            unsigned long service = 1 + ( i * 7 ) % 5;
+            start[i]->setDelayFn([]() { return 1UL; });
+            done[i]->setDelayFn([=]() { return service; });
+        }
+        for(auto t:start) t->setEnabledActions([=](unsigned long) { fired(t->_idx); });
+        for(auto t:done) t->setEnabledActions([=](unsigned long) { fired(t->_idx); });
+    }
+    ~Ring() { _pn.deleteElems(); }
+};
+
+int main(int argc, char *argv[])
+{
+    const unsigned nStations = argc > 1 ? stoul(argv[1]) : 256;
+    const unsigned nCustomers = argc > 2 ? stoul(argv[2]) : 2;
+    const unsigned nServed = argc > 3 ? stoul(argv[3]) : 2000;
+
+    vector<unsigned> seq;
+    Ring stRing(nStations, nCustomers, nServed, [&](unsigned t) { seq.push_back(t); });
+    stRing._pn.init();
+    stRing._pn.wait();
+
+    mutex firedmutex;
+    vector<pair<double,unsigned>> tw;
+    Ring twRing(nStations, nCustomers, nServed, [&](unsigned t)
+    {
+        lock_guard<mutex> lock(firedmutex);
+        tw.push_back({PNTimeWarp::now(), t});
+    });
+    PNTimeWarp sim(twRing._pn);
+    auto result = sim.run();
+    result.print(cout);
+
+    // Firings committed by different LPs are in time, then index order
+    sort(tw.begin(), tw.end());
+    bool ok = result._status == PNTimeWarpResult::DEAD and result._firings == seq.size()
+              and tw.size() == seq.size();
+    for(unsigned i=0; ok and i<seq.size(); i++) ok = tw[i].second == seq[i];
+    // Customers all back in the queues they started from
+    for(unsigned i=0; i<nStations; i++) ok = ok and result._marking[twRing._q[i]->_idx] == nCustomers;
+    cout << seq.size() << " firings, "
+         << ( ok ? "same as sequential" : "differing from sequential" ) << endl;
+    return ok ? 0 : 1;
+}
@@ -26,7 +26,22 @@ public:
     void print(ostream& ostr = cout)
     {
         if constexpr ( is_same<T,string>::value )
-            ostr << "\"" << _val << "\"";
+        {
+            ostr << "\"";
+            for(unsigned char c:_val)
+            {
+                if ( c == '"' or c == '\\' ) ostr << '\\' << c;
+                else if ( c == '\n' ) ostr << "\\n";
+                else if ( c == '\t' ) ostr << "\\t";
+                else if ( c < 0x20 )
+                {
+                    static const char hex[] = "0123456789abcdef";
+                    ostr << "\\u00" << hex[c>>4] << hex[c&15];
+                }
+                else ostr << c;
+            }
+            ostr << "\"";
+        }
         else ostr << _val;
     }
     JsonAtom(T val) : _val(val) {}
@@ -2,113 +2,363 @@
 #define _MTENGINE_H
 
 #include <list>
+#include <vector>
 #include <iostream>
 #include <queue>
 #include <mutex>
 #include <thread>
 #include <chrono>
 #include <functional>
+#include <atomic>
+#include <cstdint>
 #include <condition_variable>
+#include "wsdeque.h"
   
 using namespace std;
 
 typedef function<void()> Work;
 
-// A queue based, multithreading engine
+// A work item, either a typed task (an opcode and an argument, e.g. a
+// transition index, run by the engine's runTask) or a Work closure. Typed
+// tasks take no allocation, closures are on the heap. Packed in a word (a
+// closure pointer is even, a task has the low bit set) so that it fits the
+// lock free deque slots, the engine is the one owning the queue.
+class Task
+{
+    uintptr_t _v = 0;
+public:
+    bool typed() { return _v & 1; }
+    unsigned op() { return (uint32_t) _v >> 1; }
+    unsigned arg() { return _v >> 32; }
+    Work* work() { return (Work*) _v; }
+    Task() {}
+    Task(unsigned op, unsigned arg) : _v(( (uintptr_t) arg << 32 ) | ( op << 1 ) | 1) {}
+    Task(Work *work) : _v((uintptr_t) work) {}
+};
+static_assert(sizeof(uintptr_t) == 8 and atomic<Task>::is_always_lock_free, "Task needs 64 bit lock free atomics");
+
+// A work stealing, multithreading engine
+//
+// Each worker thread owns a lock free deque (see wsdeque.h). Work added by a
+// worker goes to its own deque and is popped LIFO by it, idle workers steal
+// FIFO from the others. Work added by threads that are not part of the pool
+// (e.g. main thread before it calls wait) goes to a global queue which all
+// workers drain.
+//
+// Engines derived from this one submit their own work as typed tasks
+// (addtask), which are queued by value, without allocation. Work closures
+// (addwork) are for the rest, e.g. work submitted by applications.
+//
+// Work may also be routed to a given worker (addwork with a worker), e.g. to
+// keep the work on some data on one core. It's pushed to the worker's inbox,
+// which the worker moves to its deque when it looks for work, so it's still
+// stolen if the worker is busy and others idle. Idle workers drain the inboxes
+// of others only once there is no other work.
+//
+// Workers that find no work park, each on its own condition variable, and
+// are woken when work is added (the worker it's routed to, if any). The
+// engine counts work items in flight (queued or running).
+// Once wait has been called, the count dropping to 0 means nothing can
+// generate more work, the engine is quiescent and wait returns.
+//
+// Built with PNSTATS, the engine and the nets running on it count contention
+// events (see Stat), readable with stats.
 // TODO: Make use of priority queue
 class MTEngine
 {
-    unsigned _lqthreshold; // Add work to _gq if _lq size exeeds this
+    unsigned _nthreads;
     list<thread*> _threads;
-    inline static thread_local queue<Work> _lq; // NOTE: Application must declare it in any one cpp file
-    queue<Work> _gq;
+    // Worker 0 is the thread calling wait, others are started by constructor
+    vector<WSDeque<Task>*> _deques;
+    // Work routed to a worker, swapped out whole by whoever drains it
+    struct alignas(64) Inbox
+    {
+        mutex _mutex;
+        vector<Task> _tasks;
+        atomic<bool> _nonempty {false};
+    };
+    vector<Inbox> _inboxes;
+    inline static thread_local vector<Task> _tldrained;
+    inline static thread_local MTEngine *_tlengine = NULL;
+    inline static thread_local unsigned _tlworker = 0;
+    inline static thread_local unsigned _tlvictimseed = 0;
+    queue<Task> _gq;
     mutex _gq_mutex;
-    condition_variable _gq_cvar;
+    atomic<unsigned long> _inflight {0}; // queued or running
+    atomic<unsigned long> _queued {0};
+    atomic<unsigned> _nidle {0};
+    atomic<bool> _waiting {false};
+    atomic<bool> _stopping {false}; // see shutdown
+    mutex _park_mutex;
+    vector<condition_variable> _park_cvars; // per worker
+    vector<bool> _parked; // under _park_mutex
+#ifdef PNSTATS
+    // Counters per worker (threads outside the pool count against worker 0),
+    // each on its own cache line, so that counting doesn't add contention
+    struct alignas(64) StatCounters { atomic<unsigned long> _cnt[5] {}; };
+    vector<StatCounters> _stats;
+#endif
 
-    void dolocal()
+    bool popglobal(Task& work)
+    {
+        countedLock(_gq_mutex);
+        const lock_guard<mutex> lockq(_gq_mutex, adopt_lock);
+        if ( _gq.empty() ) return false;
+        work = _gq.front();
+        _gq.pop();
+        return true;
+    }
+    // Starts from a pseudo random victim so that thieves spread out
+    bool steal(unsigned self, Task& work)
+    {
+        _tlvictimseed = _tlvictimseed * 1103515245 + 12345;
+        unsigned start = _tlvictimseed >> 16;
+        for(unsigned i=0; i<_nthreads; i++)
+        {
+            unsigned victim = (start + i) % _nthreads;
+            if ( victim != self and _deques[victim]->steal(work) )
+            {
+                countStat(STEALS);
+                return true;
+            }
+        }
+        return false;
+    }
+    // Moves the routed work of worker w to the deque of self
+    bool takeinbox(unsigned w, unsigned self, Task& work)
+    {
+        auto& in = _inboxes[w];
+        if ( not in._nonempty.load(memory_order_relaxed) ) return false;
+        {
+            countedLock(in._mutex);
+            const lock_guard<mutex> locki(in._mutex, adopt_lock);
+            in._tasks.swap(_tldrained);
+            in._nonempty = false;
+        }
+        for(auto t:_tldrained) _deques[self]->push(t);
+        _tldrained.clear();
+        if ( w != self ) countStat(STEALS);
+        return _deques[self]->pop(work);
+    }
+    void push(Task task)
     {
-        while( not _lq.empty() )
+        _inflight++;
+        _queued++;
+        if ( _tlengine == this ) _deques[_tlworker]->push(task);
+        else
         {
-            auto work = _lq.front();
-            _lq.pop();
-            work();
+            countedLock(_gq_mutex);
+            const lock_guard<mutex> lockq(_gq_mutex, adopt_lock);
+            _gq.push(task);
         }
+        wakeone(_nthreads);
     }
-    void dowork()
+    void push(Task task, unsigned worker)
     {
-        while(true)
+        _inflight++;
+        _queued++;
+        if ( _tlengine == this and _tlworker == worker ) _deques[worker]->push(task);
+        else
         {
-            dolocal();
-            bool qempty;
-            Work work;
+            auto& in = _inboxes[worker];
             {
-                const lock_guard<mutex> lockq(_gq_mutex);
-                qempty = _gq.empty();
-                if(!qempty)
-                {
-                    work = _gq.front();
-                    _gq.pop();
-                }
+                countedLock(in._mutex);
+                const lock_guard<mutex> locki(in._mutex, adopt_lock);
+                in._tasks.push_back(task);
+                in._nonempty = true;
             }
-            if(qempty)
+            wakeone(worker);
+        }
+    }
+    void run(Task task)
+    {
+        if ( task.typed() ) runTask(task.op(), task.arg());
+        else
+        {
+            (*task.work())();
+            delete task.work();
+        }
+    }
+    bool findwork(unsigned self, Task& work)
+    {
+        if ( _deques[self]->pop(work) or takeinbox(self, self, work) or popglobal(work) or steal(self, work) )
+            return true;
+        for(unsigned i=1; i<_nthreads; i++)
+            if ( takeinbox((self + i) % _nthreads, self, work) ) return true;
+        return false;
+    }
+    bool done() { return _quit or _stopping or ( _waiting and _inflight == 0 ); }
+    void wakeall()
+    {
+        const lock_guard<mutex> lockp(_park_mutex);
+        for(auto& cv:_park_cvars) cv.notify_all();
+    }
+    // Wakes worker w if parked, else (or with w = _nthreads) any parked one
+    void wakeone(unsigned w)
+    {
+        if ( _nidle == 0 ) return;
+        const lock_guard<mutex> lockp(_park_mutex);
+        if ( w < _nthreads and _parked[w] )
+        {
+            _park_cvars[w].notify_one();
+            return;
+        }
+        for(unsigned i=0; i<_nthreads; i++)
+            if ( _parked[i] )
             {
-                if(_quit) break;
-                else
-                {
-                    unique_lock<mutex> ulockq(_gq_mutex);
-                    _gq_cvar.wait(ulockq, []{return true;} );
-                }
+                _park_cvars[i].notify_one();
+                return;
             }
-            else work();
-        }
     }
-protected:
-    bool _quit = false;
-public:
-    void addwork(Work& work)
-    {
-        // TODO: lqthreshold heuristic is temporarily removed 1. If there are
-        // threads that are not a part of the pool how will this heuristic
-        // behave, needs to be analyzed.
-        // 2. During wait 100% CPU usage is seen
-        // 3. Find a way to notify when item is added to lq
-        //if ( _lq.size() > _lqthreshold )
-        if ( true )
+    // An adder increments _queued before reading _nidle, a parking worker
+    // increments _nidle before reading _queued (under _park_mutex), so at
+    // least one of them sees the other and a wakeup can't be lost
+    void park(unsigned self)
+    {
+        unique_lock<mutex> ulockp(_park_mutex);
+        countStat(PARKS);
+        _nidle++;
+        _parked[self] = true;
+        _park_cvars[self].wait(ulockp, [this]{ return _queued > 0 or done(); });
+        _parked[self] = false;
+        _nidle--;
+    }
+    void dowork(unsigned self)
+    {
+        _tlengine = this;
+        _tlworker = self;
+        _tlvictimseed = self;
+        while( not _stopping )
         {
+            Task work;
+            if ( findwork(self, work) )
             {
-                const lock_guard<mutex> lockq(_gq_mutex);
-                _gq.push(work);
+                _queued--;
+                run(work);
+                if ( --_inflight == 0 and _waiting ) wakeall();
             }
-            _gq_cvar.notify_one();
+            else if ( done() ) break;
+            else park(self);
         }
-        else _lq.push(work);
+        _tlengine = NULL;
     }
-
-    // Set to quit when the queue is found empty
-    void quit() { _quit = true; }
-
-    void wait()
+    void stopthreads()
     {
-        dowork(); // Let main thread also work
         for(auto t:_threads)
         {
             t->join();
             delete t;
         }
+        _threads.clear();
+    }
+protected:
+    atomic<bool> _quit {false};
+    // Runs a task queued by addtask, opcodes are up to the derived engine
+    virtual void runTask(unsigned op, unsigned arg) {}
+    // Stops and joins the pool, the tasks running are finished and the ones
+    // queued dropped. Called by the destructor of each concrete engine,
+    // before its members (which the tasks use) are destroyed, since an
+    // application may never call wait, or destroy a net that is still live.
+    void shutdown()
+    {
+        _stopping = true;
+        quit();
+        stopthreads();
+    }
+public:
+    typedef enum {QUIT,QUIESCENT} Outcome;
+    // Steals: work items stolen from other workers, Parks: times a worker
+    // went idle, LockWaits: mutex acquisitions that found it held by another
+    // thread, CASRetries: failed compare and swap attempts, FailedTriggers:
+    // firing attempts that lost input tokens to a competing transition
+    typedef enum {STEALS,PARKS,LOCKWAITS,CASRETRIES,FAILEDTRIGGERS} Stat;
+
+    void countStat(Stat stat)
+    {
+#ifdef PNSTATS
+        _stats[ _tlengine == this ? _tlworker : 0 ]._cnt[stat].fetch_add(1, memory_order_relaxed);
+#endif
+    }
+    // Locks m, with PNSTATS counting whether it had to wait for it
+    void countedLock(mutex& m)
+    {
+#ifdef PNSTATS
+        if ( m.try_lock() ) return;
+        countStat(LOCKWAITS);
+#endif
+        m.lock();
+    }
+    // Name and total of each counter, empty unless built with PNSTATS
+    vector<pair<string,unsigned long>> stats()
+    {
+        vector<pair<string,unsigned long>> ret;
+#ifdef PNSTATS
+        const char *names[] = {"steals","parks","lockwaits","casretries","failedtriggers"};
+        for(unsigned i=0; i<5; i++)
+        {
+            unsigned long total = 0;
+            for(auto& s:_stats) total += s._cnt[i];
+            ret.push_back({names[i], total});
+        }
+#endif
+        return ret;
+    }
+
+    unsigned nthreads() { return _nthreads; }
+    void addwork(Work& work) { push(Task(new Work(work))); }
+    // Routes work to the given worker (< nthreads), see above
+    void addwork(Work& work, unsigned worker) { push(Task(new Work(work)), worker); }
+    // Queues runTask(op, arg), op < 2^31
+    void addtask(unsigned op, unsigned arg) { push(Task(op, arg)); }
+    void addtask(unsigned op, unsigned arg, unsigned worker) { push(Task(op, arg), worker); }
+
+    // Set to quit when the queue is found empty
+    void quit()
+    {
+        _quit = true;
+        wakeall();
+    }
+
+    // Returns when quit is called or when no work is in flight. Work added by
+    // threads outside the pool after calling wait isn't waited for.
+    Outcome wait()
+    {
+        _waiting = true;
+        wakeall();
+        dowork(0); // Let main thread also work
+        stopthreads();
+        return _quit ? QUIT : QUIESCENT;
     }
 
     MTEngine()
     {
         char *nthreadsvar = getenv("NTHREADS");
-        unsigned nThreads = nthreadsvar ? stoi(nthreadsvar) : 1;
-        cout << "MTEngine : nThreads set to " << nThreads << endl;
-
-        char *lqthresholdvar = getenv("LQTHRESHOLD");
-        _lqthreshold = lqthresholdvar ? stoi(lqthresholdvar) : 2;
-        cout << "MTEngine : lqthreshold set to " << _lqthreshold << endl;
+        _nthreads = nthreadsvar ? stoi(nthreadsvar) : 1;
+        if ( _nthreads == 0 ) _nthreads = 1;
+        cout << "MTEngine : nThreads set to " << _nthreads << endl;
+#ifdef PNSTATS
+        _stats = vector<StatCounters>(_nthreads);
+#endif
 
+        _park_cvars = vector<condition_variable>(_nthreads);
+        _parked.assign(_nthreads, false);
+        _inboxes = vector<Inbox>(_nthreads);
+        for(unsigned i=0; i<_nthreads; i++) _deques.push_back(new WSDeque<Task>());
         // We rope in main thread once it invokes wait hence start 1 thread less
-        for(int i=0; i<nThreads-1; i++) _threads.push_back(new thread(&MTEngine::dowork,this));
+        for(unsigned i=1; i<_nthreads; i++) _threads.push_back(new thread(&MTEngine::dowork,this,i));
+    }
+    // Frees the tasks left queued, the pool is stopped by then (see shutdown)
+    virtual ~MTEngine()
+    {
+        Task work;
+        for(auto d:_deques)
+        {
+            while ( d->pop(work) ) if ( not work.typed() ) delete work.work();
+            delete d;
+        }
+        for(auto& in:_inboxes)
+            for(auto t:in._tasks) if ( not t.typed() ) delete t.work();
+        while ( popglobal(work) ) if ( not work.typed() ) delete work.work();
     }
 };
 
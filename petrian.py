@@ -1,4 +1,5 @@
 import re
+import json
 
 class PetriNet:
     # seeds : set of seeds for transitive closure
@@ -129,13 +130,15 @@ class PetriNet:
             for succ in succs:
                 self.pred[succ] = self.pred.get(succ,set()).union({pred})
 
+    # flnm is a net written by printjson
     def byFlnm(self,flnm):
-        pn = eval( open(flnm).read() )
-        self.places = { pid for (pid,_,_,_) in pn['places'] }
-        self.transitions = { tid for (tid,_,_) in pn['transitions'] }
+        with open(flnm) as fp: pn = json.load(fp)
+        self.places = { int(pid) for pid in pn['places'] }
+        self.transitions = { int(tid) for tid in pn['transitions'] }
         self.nodes = self.places.union(self.transitions)
-        self.labels = { p_or_t[0]:p_or_t[1] for p_or_t in pn['places'] + pn['transitions'] }
-        self.succ = { p_or_t[0]:p_or_t[-1] for p_or_t in pn['places'] + pn['transitions'] }
+        self.labels = { int(id):node['label'] for kind in ('places','transitions') for (id,node) in pn[kind].items() }
+        self.succ = { n:set() for n in self.nodes }
+        for arc in pn['arcs']: self.succ[arc['src']].add(arc['tgt'])
         self.buildPreds()
 
     def __init__(self,flnm=None):
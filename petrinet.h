@@ -17,12 +17,15 @@
 //                          higher in this mode.
 //
 // SIMU_MODE_RANDOMPICK :   Transitions are picked uniformly randomly from
-//                          among enabled transitions. At present this is just
-//                          an experimental mode.
+//                          among enabled transitions. Each enabled transition
+//                          is held once in an indexed set, so a pick is O(1).
 //
 // SIMU_MODE_STPN       :   This is just like the Default mode explained below,
-//                          just that the simulation time tracked and advanced
-//                          after processing every transition. The transitions
+//                          just that the simulation time is tracked and
+//                          advanced to the scheduled time of every transition
+//                          fired. A transition disabled before its time comes
+//                          is descheduled and gets a fresh delay on getting
+//                          enabled again. The transitions
 //                          enabled first tend to get a higher priority than a
 //                          transition enabled later. Hence this mode may not
 //                          be useful for uncovering rarely occurring
@@ -36,29 +39,45 @@
 // Default              :   Transitions are assigned with a delay using
 //                          callback function set using setDelayFn. Default
 //                          delay (if setDelayFn isn't called) is 0.
+//
+// STPetriNet fires transitions in a single simulation loop that owns the
+// marking, so the firing path takes no locks. Tokens added from other threads
+// are queued to the loop, which applies them and runs their add actions.
 
 #include <iostream>
 #include <string>
 #include <list>
 #include <queue>
 #include <set>
+#include <vector>
+#include <algorithm>
+#include <climits>
 #if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_RANDOMPRIO )
-#   include <random>
+#   include "pnrandom.h"
 #endif
-#ifdef USESEQNO
+#include "pnqueues.h"
+#include "pnarena.h"
+#include "pnimage.h"
+#if defined( USESEQNO ) || defined( PN_ATOMIC_TOKENS )
 #   include <atomic>
 #endif
 #include "dot.h"
 #include "mtengine.h"
 #include "jsonprinter.h"
+#ifdef PNDBG
+#   include "pnlog.h"
+#endif
+
+#ifdef PN_BATCHED_EVENT_LISTENER
+#   ifndef PN_USE_EVENT_LISTENER
+#       define PN_USE_EVENT_LISTENER
+#   endif
+#endif
 
 #ifdef PNDBG
-#   define PNLOG(ARGS) \
-    _pn->pnlogmutex.lock(); \
-    _pn->pnlog << ARGS << endl; \
-    _pn->pnlogmutex.unlock();
+#   define PNLOG(TYP, DELTA, TOKENS, SEQNO) _pn->_pnlog.log(PNLogRecord::TYP, _nodeid, DELTA, TOKENS, SEQNO);
 #else
-#   define PNLOG(ARGS)
+#   define PNLOG(TYP, DELTA, TOKENS, SEQNO)
 #endif
 
 // Design Note: Some methods that should ideally belong to PNPlace /
@@ -74,27 +93,78 @@ class PNPlace;
 class PNQuitPlace;
 class PNTransition;
 class PNNode;
+#ifdef PN_ATOMIC_TOKENS
+typedef atomic<unsigned> PNCount;
+#else
+typedef unsigned PNCount;
+#endif
 typedef vector<PNArc*> Arcs; // a vector to aid filtering by indices
-typedef set<PNPlace*> Places;
-typedef set<PNTransition*> Transitions;
+typedef vector<PNPlace*> Places;           // indexed by PNNode::_idx
+typedef vector<PNTransition*> Transitions; // indexed by PNNode::_idx
+
+// Arc for bulk construction (see PetriNetBase::createArcs), from a place to a
+// transition or the other way round, given by node ids
+class PNArcSpec
+{
+public:
+    unsigned _src;
+    unsigned _dst;
+    unsigned _wt = 1;
+};
+static_assert(sizeof(PNArcSpec) == 12, "PNArcSpec is the arc record of net images");
+
+class PNEvent
+{
+public:
+    unsigned _e;            // nodeid of the transition fired
+    unsigned long _eseqno;
+};
 
 // Interfaces to resolve inter-dependencies
+//
+// With PN_BATCHED_EVENT_LISTENER, events are queued on per thread rings
+// instead of being delivered on the firing thread, and a background thread
+// hands them over to the listener in spans (see PNThreadRings). Ordering
+// guarantees then are:
+// - The listener is called from one thread at a time, never concurrently.
+// - Events fired by one thread are delivered in the order of firing, events
+//   fired by different threads in no particular order (use eseqno with
+//   USESEQNO to order them).
+// - The actions of a transition may run before the listener sees its event.
+// - All events fired before wait returns are delivered before it returns.
+// PN_USE_EVENT_LISTENER alone retains synchronous delivery, where the
+// listener sees an event before its actions run.
 class IPetriNet : public MTEngine
 {
     function<void(unsigned, unsigned long)> _eventListener;
+#ifdef PN_BATCHED_EVENT_LISTENER
+    function<void(PNEvent*, unsigned)> _batchListener = NULL;
+    PNThreadRings<PNEvent> _events;
+    void deliver(PNEvent* events, unsigned n)
+    {
+        if ( _batchListener ) _batchListener(events, n);
+        else
+            for(unsigned i=0; i<n; i++) _eventListener(events[i]._e, events[i]._eseqno);
+    }
+#endif
     void setLogfile(string logfile)
     {
 #ifdef PNDBG
-    pnlog.open(logfile);
+    _pnlog.open(logfile);
 #endif
     }
 public:
     string _netname;
 #ifdef PNDBG
-    ofstream pnlog;
-    mutex pnlogmutex;
+    PNLogger _pnlog;
 #endif
     unsigned _idcntr = 0;
+    PNNames _names; // of the nodes
+    unsigned _placecntr = 0;
+    unsigned _transitioncntr = 0;
+    // Current token count of each place indexed by PNPlace::_idx, sized when
+    // the net is frozen
+    vector<PNCount> _tokens;
 #   ifdef USESEQNO
     atomic<unsigned long> _eseqno = 0;
 #   endif
@@ -106,10 +176,41 @@ public:
     virtual void printpnml(string filename="petri.pnml")=0;
     virtual void deleteElems()=0;
     virtual void addtokens(PNPlace* place, unsigned newtokens)=0;
-    void tellListener(unsigned e, unsigned long eseqno) { _eventListener(e, eseqno); }
+    void tellListener(unsigned e, unsigned long eseqno)
+    {
+#ifdef PN_BATCHED_EVENT_LISTENER
+        _events.push({e, eseqno});
+#else
+        _eventListener(e, eseqno);
+#endif
+    }
+#ifdef PN_BATCHED_EVENT_LISTENER
+    // Listener taking a span of events at a time, used instead of the per
+    // event listener passed to the constructor. Set it before adding tokens.
+    void setBatchListener(function<void(PNEvent*, unsigned)> bl) { _batchListener = bl; }
+    // Delivers the events queued so far
+    void flushEvents() { _events.flush(); }
+#endif
+    // Returns once a quit place gets a token or when the net is dead i.e. no
+    // transition is enabled and no work is in flight
+    Outcome wait()
+    {
+        auto outcome = MTEngine::wait();
+#ifdef PN_BATCHED_EVENT_LISTENER
+        flushEvents();
+#endif
+#ifdef PNDBG
+        _pnlog.flush();
+#endif
+        if ( outcome == QUIESCENT ) cout << "PN_DEAD:" << _netname << endl;
+        return outcome;
+    }
     IPetriNet(string netname, function<void(unsigned,unsigned long)> eventListener) : _netname(netname), _eventListener(eventListener)
     {
-        setLogfile(netname+".petri.log");
+        setLogfile(netname+".petri.bin");
+#ifdef PN_BATCHED_EVENT_LISTENER
+        _events.start([this](PNEvent* events, unsigned n) { deliver(events, n); });
+#endif
     }
 };
 
@@ -140,14 +241,17 @@ protected:
     IPetriNet* _pn;
 public:
     const unsigned _nodeid;
+    // Dense index among places or transitions (whichever this node is), used
+    // to address the compiled net
+    const unsigned _idx;
     Arcs _iarcs;
     Arcs _oarcs;
-    const string _name;
+    const string& _name; // interned, see IPetriNet::_names
     void addiarc(PNArc* a) { _iarcs.push_back(a); }
     void addoarc(PNArc* a) { _oarcs.push_back(a); }
     string idlabel() { return idstr() + ":" + _name; }
     string idstr() { return to_string(_nodeid); }
-    PNNode(string name, IPetriNet* pn) : _name(name), _nodeid(pn->_idcntr++), _pn(pn) {}
+    PNNode(string name, IPetriNet* pn, unsigned idx) : _name(pn->_names.intern(name)), _nodeid(pn->_idcntr++), _idx(idx), _pn(pn) {}
 };
 
 class PNPlace : public PNNode
@@ -155,13 +259,12 @@ class PNPlace : public PNNode
     function<list<int>()> _arcchooser = NULL;
     unsigned _marking;
     unsigned _capacity;
-    mutex _tokenmutex;
 protected:
     function<void()> _addactions = [](){};
 public:
     virtual void addactions(unsigned newtokens)
     {
-        PNLOG("p:" << idstr() << ":+" << newtokens << ":" << _tokens << ":" << _name)
+        PNLOG(ADD, newtokens, tokens(), 0)
         _addactions();
     }
     Arcs eligibleArcs()
@@ -176,34 +279,24 @@ public:
         }
         else return _oarcs;
     }
+    bool hasArcChooser() { return _arcchooser != NULL; }
+    list<int> chooseArcs() { return _arcchooser(); }
     void setMarking(unsigned marking) { _marking = marking; }
     void setCapacity(unsigned capacity) { _capacity = capacity; }
     // This can be put on queue by adding a wrapper that does addwork, for granularity reason it wasn't
     unsigned marking() { return _marking; }
     unsigned capacity() { return _capacity; }
-    unsigned _tokens = 0;
+    unsigned tokens() { return _idx < _pn->_tokens.size() ? (unsigned) _pn->_tokens[_idx] : 0; }
     Etyp typ() { return PLACE; }
     void setArcChooser(function<list<int>()> f) { _arcchooser = f; }
     void setAddActions(function<void()> af) { _addactions = af; }
     virtual void deductactions(unsigned dedtokens)
     {
-        PNLOG("p:" << idstr() << ":-" << dedtokens << ":" << _tokens << ":" << _name)
-    }
-    void lock() { _tokenmutex.lock(); }
-    bool lockIfEnough(unsigned mintokens)
-    {
-        lock();
-        if(_tokens >= mintokens) return true;
-        else
-        {
-            unlock();
-            return false;
-        }
+        PNLOG(DEDUCT, dedtokens, tokens(), 0)
     }
-    void unlock() { _tokenmutex.unlock(); }
     DNode dnode() { return DNode(idstr(),(Proplist){{"label","p:"+idlabel()}}); }
     // capacity 0 means place can hold unlimited tokens
-    PNPlace(string name, IPetriNet* pn, unsigned marking=0,unsigned capacity=1) : PNNode(name, pn), _capacity(capacity), _marking(marking) {}
+    PNPlace(string name, IPetriNet* pn, unsigned marking=0,unsigned capacity=1) : PNNode(name, pn, pn->_placecntr++), _capacity(capacity), _marking(marking) {}
     virtual ~PNPlace() {}
 };
 
@@ -214,7 +307,7 @@ class PNTransition : public PNNode
 public:
     virtual void notEnoughTokensActions()
     {
-        PNLOG("wait:" << idlabel())
+        PNLOG(WAIT, 0, 0, 0)
     }
     void enabledactions(unsigned long eseqno)
     {
@@ -222,31 +315,19 @@ public:
 // Usually it is expected that the listener is some event sequence analyzer (such as a CEP tool)
 // while actions may trigger state changes under the main system under simulation. This sequence ensures
 // that the state changes caused by this event happen only after the listener sees the event.
+// With PN_BATCHED_EVENT_LISTENER the event is only queued for the listener here (see IPetriNet).
 #       ifdef PN_USE_EVENT_LISTENER
         _pn->tellListener(_nodeid, eseqno);
 #       endif
-        PNLOG("t:" << idlabel() << ":" << eseqno)
+        PNLOG(FIRE, 0, 0, eseqno)
         _enabledactions(eseqno);
     }
-    // Although tryTrigger is called only when preceding places have enough
-    // tokens, there can be other contenders for those tokens who may consume
-    // them, hence we need to check again whether this transition can fire by
-    // holding all predecessor places' counts under a lock
-    unsigned _enabledPlaceCnt = 0;
-    mutex _enabledPlaceCntMutex;
-    bool hasEnabledPlaces() { return _enabledPlaceCnt == _iarcs.size(); }
-    bool mayFire()
-    {
-        for(auto ia:_iarcs)
-            if ( ia->_place->_tokens < ia->_wt ) return false;
-        return true;
-    }
     void setEnabledActions(function<void(unsigned long)> af) { _enabledactions = af; }
     void setDelayFn( function<unsigned long()> df ) { _delayfn = df; }
     unsigned long delay() { return _delayfn(); }
     Etyp typ() { return TRANSITION; }
     DNode dnode() { return DNode(idstr(),(Proplist){{"shape","rectangle"},{"label","t:"+idlabel()}}); }
-    PNTransition(string name, IPetriNet *pn): PNNode(name, pn) {}
+    PNTransition(string name, IPetriNet *pn): PNNode(name, pn, pn->_transitioncntr++) {}
     virtual ~PNTransition() {}
 };
 
@@ -284,11 +365,414 @@ public:
     void addactions(unsigned) { _pn->quit(); }
 };
 
+// Flat layout of the net structure in compressed sparse row (CSR) form, built
+// once by PetriNetBase::freeze so that the firing hot path walks contiguous
+// index arrays instead of chasing arc objects. Places and transitions are
+// addressed by their _idx. Adjacency of node i is [off[i],off[i+1]) in the
+// respective node index and weight arrays. Parallel arcs between the same
+// place and transition are merged by adding up their weights. Transition rows
+// are sorted by place index (which also gives a global lock order), place
+// rows by weight so that the arcs whose threshold a token count change
+// crosses can be found by binary search (see forCrossedArcs).
+class PNCompiledNet
+{
+    typedef vector<pair<unsigned,unsigned>> Row;
+    static void addrow(Row& row, PNArray<unsigned>& off, PNArray<unsigned>& idx, PNArray<unsigned>& wt, bool byweight=false)
+    {
+        sort(row.begin(), row.end());
+        Row merged;
+        for(auto& a:row)
+        {
+            if ( not merged.empty() and a.first == merged.back().first ) merged.back().second += a.second;
+            else merged.push_back(a);
+        }
+        if ( byweight )
+            stable_sort(merged.begin(), merged.end(), [](auto& l, auto& r){ return l.second < r.second; });
+        for(auto& a:merged)
+        {
+            idx.push_back(a.first);
+            wt.push_back(a.second);
+        }
+        off.push_back(idx.size());
+    }
+public:
+    vector<PNPlace*> _places;
+    vector<PNTransition*> _transitions;
+    // Built by compile, or views of a net image
+    PNArray<unsigned> _tioff, _tiplace, _tiwt; // transition -> input places
+    PNArray<unsigned> _tooff, _toplace, _towt; // transition -> output places
+    PNArray<unsigned> _pooff, _potrans, _powt; // place -> consumer transitions
+    PNArray<unsigned> _pioff, _pitrans, _piwt; // place -> producer transitions
+    vector<bool> _isquit; // place is a PNQuitPlace
+    // Of the arrays, _places and _transitions are empty for a bare view
+    unsigned _nplaces = 0, _ntransitions = 0;
+    unsigned nplaces() { return _nplaces; }
+    unsigned ntransitions() { return _ntransitions; }
+    unsigned ninputs(unsigned t) { return _tioff[t+1] - _tioff[t]; }
+    // (nodeid, name) of all places and transitions
+    vector<pair<unsigned,string>> nodeNames()
+    {
+        vector<pair<unsigned,string>> ret;
+        for(auto p:_places) ret.push_back({p->_nodeid, p->_name});
+        for(auto t:_transitions) ret.push_back({t->_nodeid, t->_name});
+        return ret;
+    }
+    // Position of consumer transition t in place p's row
+    unsigned consumerPos(unsigned p, unsigned t)
+    {
+        return find(_potrans.begin() + _pooff[p], _potrans.begin() + _pooff[p+1], t) - _potrans.begin();
+    }
+    // Calls f with the index of each arc in place p's consumer row whose
+    // weight lies in (lo,hi], i.e. whose threshold is crossed when the token
+    // count of p moves between lo and hi (either way)
+    template<typename F> void forCrossedArcs(unsigned p, unsigned lo, unsigned hi, F f)
+    {
+        auto b = _powt.data() + _pooff[p], e = _powt.data() + _pooff[p+1];
+        for(auto w = upper_bound(b, e, lo); w != e and *w <= hi; w++) f(w - _powt.data());
+    }
+    // Calls f with the index (into the consumer arrays) of each arc out of
+    // place p that may get enabled on adding tokens
+    template<typename F> void forEligibleArcs(unsigned p, F f)
+    {
+        auto place = _places[p];
+        if ( place->hasArcChooser() )
+        {
+            for(auto i:place->chooseArcs())
+                f(consumerPos(p, place->_oarcs[i]->_transition->_idx));
+        }
+        else for(unsigned i=_pooff[p]; i<_pooff[p+1]; i++) f(i);
+    }
+    // Reports place p holding more tokens than its capacity
+    void checkCapacity(unsigned p, unsigned tokens)
+    {
+        auto place = _places[p];
+        if ( place->capacity() > 0 and tokens > place->capacity() )
+        {
+            cout << "PN_PLACE_CAPACITY_EXCEPTION:" << place->idlabel() << ":"
+                << place->capacity() << ":" << tokens << endl;
+        }
+    }
+    // Number of places with consumers or producers in more than one part
+    unsigned sharedPlaces(const vector<unsigned>& part)
+    {
+        unsigned n = 0;
+        for(unsigned p=0; p<nplaces(); p++)
+        {
+            unsigned first = UINT_MAX;
+            bool shared = false;
+            auto see = [&](unsigned t) { if ( first == UINT_MAX ) first = part[t]; else shared = shared or part[t] != first; };
+            for(unsigned i=_pooff[p]; i<_pooff[p+1]; i++) see(_potrans[i]);
+            for(unsigned i=_pioff[p]; i<_pioff[p+1]; i++) see(_pitrans[i]);
+            n += shared;
+        }
+        return n;
+    }
+    // Splits the transitions into nparts parts of about equal size, keeping
+    // transitions that share places together: connected components (over
+    // shared places) go whole to the least loaded part, largest first. A
+    // component too large for a part is cut two ways, keeping the one that
+    // leaves fewer places shared: by growing parts breadth first from seeds
+    // (good for rings and meshes), or into runs of a depth first order (good
+    // for trees, which it cuts into subtrees). Returns the part of each
+    // transition.
+    vector<unsigned> partition(unsigned nparts)
+    {
+        auto grown = partition(nparts, false), runs = partition(nparts, true);
+        return sharedPlaces(runs) < sharedPlaces(grown) ? runs : grown;
+    }
+    vector<unsigned> partition(unsigned nparts, bool depthfirst)
+    {
+        const unsigned NONE = UINT_MAX;
+        unsigned nt = ntransitions(), cap = ( nt + nparts - 1 ) / nparts;
+        vector<unsigned> part(nt, NONE), load(nparts, 0);
+        vector<unsigned> order, compoff; // components one after another
+        order.reserve(nt);
+        // Searches go over transitions and places, node n < nt is transition
+        // n, else place n - nt. Neighbours of a transition are its input and
+        // output places, of a place its consumers and producers.
+        auto degree = [&](unsigned n)
+        {
+            if ( n < nt ) return _tioff[n+1] - _tioff[n] + _tooff[n+1] - _tooff[n];
+            return _pooff[n-nt+1] - _pooff[n-nt] + _pioff[n-nt+1] - _pioff[n-nt];
+        };
+        auto neighbour = [&](unsigned n, unsigned k)
+        {
+            if ( n < nt )
+            {
+                unsigned nin = _tioff[n+1] - _tioff[n];
+                return nt + ( k < nin ? _tiplace[_tioff[n]+k] : _toplace[_tooff[n]+k-nin] );
+            }
+            unsigned p = n - nt, nout = _pooff[p+1] - _pooff[p];
+            return k < nout ? _potrans[_pooff[p]+k] : _pitrans[_pioff[p]+k-nout];
+        };
+        // Breadth first from transition s over the nodes that take accepts
+        // (places once per search), appends the transitions to queue
+        vector<unsigned> queue;
+        vector<unsigned> stamp(nt + nplaces(), NONE);
+        unsigned run = 0;
+        auto grow = [&](unsigned s, auto take)
+        {
+            run++;
+            size_t h = queue.size();
+            take(s);
+            stamp[s] = run;
+            queue.push_back(s);
+            for(; h<queue.size(); h++)
+                for(unsigned k=0, n=queue[h], d=degree(n); k<d; k++)
+                {
+                    unsigned p = neighbour(n, k);
+                    if ( stamp[p] == run ) continue;
+                    stamp[p] = run;
+                    for(unsigned j=0, dp=degree(p); j<dp; j++)
+                    {
+                        unsigned t = neighbour(p, j);
+                        if ( stamp[t] != run and take(t) )
+                        {
+                            stamp[t] = run;
+                            queue.push_back(t);
+                        }
+                    }
+                }
+        };
+        vector<bool> seen(nt + nplaces(), false);
+        vector<pair<unsigned,unsigned>> stack; // node, its next neighbour
+        for(unsigned s=0; s<nt; s++)
+        {
+            if ( seen[s] ) continue;
+            compoff.push_back(order.size());
+            if ( not depthfirst )
+            {
+                grow(s, [&](unsigned t) { return not seen[t] and ( seen[t] = true ); });
+                order.insert(order.end(), queue.begin(), queue.end());
+                queue.clear();
+                continue;
+            }
+            seen[s] = true;
+            order.push_back(s);
+            stack.push_back({s, 0});
+            while ( not stack.empty() )
+            {
+                auto& top = stack.back();
+                if ( top.second == degree(top.first) )
+                {
+                    stack.pop_back();
+                    continue;
+                }
+                unsigned m = neighbour(top.first, top.second++);
+                if ( seen[m] ) continue;
+                seen[m] = true;
+                if ( m < nt ) order.push_back(m);
+                stack.push_back({m, 0});
+            }
+        }
+        compoff.push_back(nt);
+        vector<unsigned> comps(compoff.size() - 1);
+        for(unsigned c=0; c<comps.size(); c++) comps[c] = c;
+        stable_sort(comps.begin(), comps.end(), [&](unsigned l, unsigned r)
+            { return compoff[l+1] - compoff[l] > compoff[r+1] - compoff[r]; });
+        auto leastLoaded = [&]() { return (unsigned) ( min_element(load.begin(), load.end()) - load.begin() ); };
+        for(auto c:comps)
+        {
+            unsigned least = leastLoaded();
+            bool fits = compoff[c+1] - compoff[c] <= cap - load[least];
+            for(unsigned i=compoff[c]; i<compoff[c+1]; i++)
+            {
+                if ( part[order[i]] != NONE ) continue;
+                if ( not fits and ( not depthfirst or load[least] == cap ) ) least = leastLoaded();
+                if ( fits or depthfirst )
+                {
+                    part[order[i]] = least;
+                    load[least]++;
+                    continue;
+                }
+                // seeds a part, grown till full
+                grow(order[i], [&](unsigned t)
+                {
+                    if ( part[t] != NONE or load[least] == cap ) return false;
+                    part[t] = least;
+                    load[least]++;
+                    return true;
+                });
+                queue.clear();
+            }
+        }
+        return part;
+    }
+    void compile(Places& places, Transitions& transitions)
+    {
+        _places = places;
+        _transitions = transitions;
+        _nplaces = _places.size();
+        _ntransitions = _transitions.size();
+        Row row;
+        _tioff.push_back(0);
+        _tooff.push_back(0);
+        for(auto t:_transitions)
+        {
+            row.clear();
+            for(auto a:t->_iarcs) row.push_back({a->_place->_idx, a->_wt});
+            addrow(row, _tioff, _tiplace, _tiwt);
+            row.clear();
+            for(auto a:t->_oarcs) row.push_back({a->_place->_idx, a->_wt});
+            addrow(row, _tooff, _toplace, _towt);
+        }
+        _pooff.push_back(0);
+        _pioff.push_back(0);
+        for(auto p:_places)
+        {
+            _isquit.push_back(dynamic_cast<PNQuitPlace*>(p) != NULL);
+            row.clear();
+            for(auto a:p->_oarcs) row.push_back({a->_transition->_idx, a->_wt});
+            addrow(row, _pooff, _potrans, _powt, true);
+            row.clear();
+            for(auto a:p->_iarcs) row.push_back({a->_transition->_idx, a->_wt});
+            addrow(row, _pioff, _pitrans, _piwt, true);
+        }
+    }
+    // Uses the arrays of a net image (see PetriNetBase::loadImage) in place
+    // of compiling, for the nodes built from it
+    void view(Places& places, Transitions& transitions, PNImage& image)
+    {
+        if ( places.size() != image.header()._nplaces or transitions.size() != image.header()._ntransitions )
+        {
+            cout << "PNImage : compiled net doesn't match the nodes" << endl;
+            exit(1);
+        }
+        _places = places;
+        _transitions = transitions;
+        view(image);
+    }
+    // Bare view of the arrays of a net image, without any nodes (e.g. see
+    // PNProcSim), after checking that their sizes are consistent and that
+    // the rows are as compile builds them
+    void view(PNImage& image)
+    {
+        typedef PNImageHeader H;
+        _nplaces = image.header()._nplaces;
+        _ntransitions = image.header()._ntransitions;
+        auto nodes = image.section<PNImageNode>(H::NODES);
+        for(uint64_t i=0; i<image.count(H::NODES); i++)
+            if ( nodes[i]._kind != PNImageNode::TRANSITION ) _isquit.push_back(nodes[i]._kind == PNImageNode::QUITPLACE);
+        auto arr = [&](PNArray<unsigned>& a, H::Section s) { a.view(image.section<unsigned>(s), image.count(s)); };
+        arr(_tioff, H::TIOFF); arr(_tiplace, H::TIPLACE); arr(_tiwt, H::TIWT);
+        arr(_tooff, H::TOOFF); arr(_toplace, H::TOPLACE); arr(_towt, H::TOWT);
+        arr(_pooff, H::POOFF); arr(_potrans, H::POTRANS); arr(_powt, H::POWT);
+        arr(_pioff, H::PIOFF); arr(_pitrans, H::PITRANS); arr(_piwt, H::PIWT);
+        auto rows = [&](PNArray<unsigned>& off, unsigned n, PNArray<unsigned>& idx, PNArray<unsigned>& wt)
+        {
+            return off.size() == n + 1 and off[0] == 0 and off[n] == idx.size() and idx.size() == wt.size();
+        };
+        if ( not ( _isquit.size() == nplaces()
+                   and rows(_tioff, ntransitions(), _tiplace, _tiwt) and rows(_tooff, ntransitions(), _toplace, _towt)
+                   and rows(_pooff, nplaces(), _potrans, _powt) and rows(_pioff, nplaces(), _pitrans, _piwt) ) )
+        {
+            cout << "PNImage : compiled net doesn't match the nodes" << endl;
+            exit(1);
+        }
+        // Offsets first, the rows are read through them. Indices must be in
+        // range, transition rows sorted by place index (the lock order) and
+        // place rows by weight (see forCrossedArcs).
+        auto sorted = [&](PNArray<unsigned>& off, unsigned n, PNArray<unsigned>& idx, PNArray<unsigned>& wt,
+                          unsigned nidx, bool byweight)
+        {
+            for(unsigned r=0; r<n; r++)
+                if ( off[r] > off[r+1] ) return false;
+            for(unsigned r=0; r<n; r++)
+                for(unsigned i=off[r]; i<off[r+1]; i++)
+                {
+                    if ( idx[i] >= nidx ) return false;
+                    if ( i > off[r] and ( byweight ? wt[i] < wt[i-1] : idx[i] <= idx[i-1] ) ) return false;
+                }
+            return true;
+        };
+        if ( not ( _tiplace.size() == _potrans.size() and _toplace.size() == _pitrans.size()
+                   and sorted(_tioff, ntransitions(), _tiplace, _tiwt, nplaces(), false)
+                   and sorted(_tooff, ntransitions(), _toplace, _towt, nplaces(), false)
+                   and sorted(_pooff, nplaces(), _potrans, _powt, ntransitions(), true)
+                   and sorted(_pioff, nplaces(), _pitrans, _piwt, ntransitions(), true) ) )
+        {
+            cout << "PNImage : compiled net has bad rows" << endl;
+            exit(1);
+        }
+    }
+};
+
+// Marking of a net fired by a single thread (STPetriNet's loop, a replica
+// of STPetriNetBatch) along with the queue Q (PNIndexedHeap or PNIndexedSet)
+// of its enabled transitions, so that both follow the same firing rules. A
+// transition is in the queue exactly when it is enabled (barring arc
+// choosers, see add), hence the queue never holds stale or duplicate
+// entries. The order is up to the user, who queues (with a priority) the
+// transitions add reports getting enabled. Tokens are the user's, C is
+// their count type.
+template<typename Q, typename C> class PNMarking
+{
+    PNCompiledNet *_cn = NULL;
+    vector<C> *_tokens = NULL;
+    // Number of input places of a transition having enough tokens
+    vector<unsigned> _enabledPlaceCnt;
+public:
+    Q _tq;
+    void init(PNCompiledNet& cn, vector<C>& tokens)
+    {
+        _cn = &cn;
+        _tokens = &tokens;
+        _enabledPlaceCnt.assign(cn.ntransitions(), 0);
+        _tq.resize(cn.ntransitions());
+    }
+    bool enabled(unsigned t) { return _enabledPlaceCnt[t] == _cn->ninputs(t); }
+    // Adds tokens to place p and calls enqueue(t) for each transition thus
+    // enabled that isn't queued yet. Every threshold crossing is counted,
+    // but with an arc chooser on p (see PNPlace::setArcChooser) only
+    // transitions on eligible arcs are enqueued.
+    template<typename E> void add(unsigned p, unsigned newtokens, E enqueue)
+    {
+        auto& tokens = *_tokens;
+        unsigned oldcnt = tokens[p];
+        tokens[p] += newtokens;
+#       ifdef PN_PLACE_CAPACITY_EXCEPTION
+        _cn->checkCapacity(p, tokens[p]);
+#       endif
+        auto enqueueIfEnabled = [&](unsigned i)
+        {
+            auto t = _cn->_potrans[i];
+            if ( enabled(t) and not _tq.contains(t) ) enqueue(t);
+        };
+        _cn->forCrossedArcs(p, oldcnt, oldcnt+newtokens, [&](unsigned i)
+        {
+            _enabledPlaceCnt[_cn->_potrans[i]]++;
+        });
+        if ( _cn->_places[p]->hasArcChooser() ) _cn->forEligibleArcs(p, enqueueIfEnabled);
+        else _cn->forCrossedArcs(p, oldcnt, oldcnt+newtokens, enqueueIfEnabled);
+    }
+    // Takes tokens out of place p, dequeuing the transitions thus disabled
+    void take(unsigned p, unsigned tokens)
+    {
+        unsigned oldcnt = (*_tokens)[p];
+        (*_tokens)[p] -= tokens;
+        _cn->forCrossedArcs(p, oldcnt-tokens, oldcnt, [&](unsigned i)
+        {
+            auto t = _cn->_potrans[i];
+            if ( enabled(t) ) _tq.remove(t);
+            _enabledPlaceCnt[t]--;
+        });
+    }
+};
+
 class PetriNetBase : public IPetriNet
 {
+    once_flag _freezeonce;
+    void assertNotFrozen(string name)
+    {
+        if ( _frozen )
+        {
+            cout << "Net is frozen, can't add: " << name << endl;
+            exit(1);
+        }
+    }
     void assertPlacePresent(PNPlace* n)
     {
-        if ( _places.find(n) == _places.end() )
+        if ( n->_idx >= _places.size() or _places[n->_idx] != n )
         {
             cout << "Place not found: " << n->_name << endl;
             exit(1);
@@ -296,36 +780,90 @@ class PetriNetBase : public IPetriNet
     }
     void assertTransitionPresent(PNTransition* n)
     {
-        if ( _transitions.find(n) == _transitions.end() )
+        if ( n->_idx >= _transitions.size() or _transitions[n->_idx] != n )
         {
             cout << "Transition not found: " << n->_name << endl;
             exit(1);
         }
     }
+    // Creates the arcs given to createArcs (or loaded from an image), after
+    // checking them all in one pass. Node arc lists are sized up front.
+    void buildArcs(const PNArcSpec *arcs, size_t narcs)
+    {
+        vector<unsigned> nin(_nodes.size(), 0), nout(_nodes.size(), 0);
+        for(size_t i=0; i<narcs; i++)
+        {
+            auto& a = arcs[i];
+            if ( a._src >= _nodes.size() or a._dst >= _nodes.size() or a._wt == 0
+                 or _nodes[a._src]->typ() == _nodes[a._dst]->typ() )
+            {
+                cout << "Bad arc: " << a._src << "->" << a._dst << ":" << a._wt << endl;
+                exit(1);
+            }
+            nout[a._src]++;
+            nin[a._dst]++;
+        }
+        for(unsigned i=0; i<_nodes.size(); i++)
+        {
+            _nodes[i]->_iarcs.reserve(_nodes[i]->_iarcs.size() + nin[i]);
+            _nodes[i]->_oarcs.reserve(_nodes[i]->_oarcs.size() + nout[i]);
+        }
+        _arcs.reserve(_arcs.size() + narcs);
+        for(size_t i=0; i<narcs; i++)
+        {
+            auto src = _nodes[arcs[i]._src], dst = _nodes[arcs[i]._dst];
+            if ( src->typ() == PNElement::PLACE ) _arcs.push_back(_arena.make<PNPTArc>((PNPlace*)src, (PNTransition*)dst, arcs[i]._wt));
+            else _arcs.push_back(_arena.make<PNTPArc>((PNTransition*)src, (PNPlace*)dst, arcs[i]._wt));
+        }
+    }
+    void buildPendingArcs()
+    {
+        buildArcs(_pendingArcs.data(), _pendingArcs.size());
+        _pendingArcs.clear();
+        _pendingArcs.shrink_to_fit();
+    }
 protected:
+    PNArena _arena; // of the elements
     Places _places;
     Transitions _transitions;
+    vector<PNNode*> _nodes; // indexed by PNNode::_nodeid
     Arcs _arcs;
+    vector<PNArcSpec> _pendingArcs; // see createArcs
+    PNImage _image; // of a loaded net
+    PNCompiledNet _cn;
+    bool _frozen = false;
     virtual void _postinit() {}
-    void checkPlaceCapacityException(PNPlace *p)
+    // Lets the PN variants size their per place / transition state
+    virtual void _postfreeze() {}
+    // Adds tokens to place with index p, the firing hot path calls this
+    // directly, addtokens maps a PNPlace to it
+    virtual void deposit(unsigned p, unsigned newtokens)=0;
+    void checkPlaceCapacityException(unsigned p) { _cn.checkCapacity(p, _tokens[p]); }
+    bool mayFire(unsigned t)
     {
-        if ( p->capacity() > 0 and p->_tokens > p->capacity() )
-        {
-            cout << "PN_PLACE_CAPACITY_EXCEPTION:" << p->idlabel() << ":"
-                << p->capacity() << ":" << p->_tokens << endl;
-        }
+        for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+            if ( _tokens[_cn._tiplace[i]] < _cn._tiwt[i] ) return false;
+        return true;
     }
     // Note: Fire is to be called after deducting tokens from sources
-    // it will add tokens to destinations
-    void fire(PNTransition* t)
+    // it will add tokens to destinations. n firings at once (see
+    // MTPetriNet::setBatchFiring) run the actions n times, with consecutive
+    // eseqnos, and deposit n times the weights in one go.
+    void fire(unsigned t, unsigned n = 1)
     {
-        for(auto iarc:t->_iarcs) iarc->_place->deductactions(iarc->_wt);
+#       ifdef PNDBG
+        for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+            _cn._places[_cn._tiplace[i]]->deductactions(_cn._tiwt[i] * n);
+#       endif
+        auto tr = _cn._transitions[t];
 #       ifdef USESEQNO
-        t->enabledactions ( _eseqno++ );
+        unsigned long eseqno = _eseqno.fetch_add(n);
+        for(unsigned j=0; j<n; j++) tr->enabledactions ( eseqno + j );
 #       else
-        t->enabledactions ( 0 );
+        for(unsigned j=0; j<n; j++) tr->enabledactions ( 0 );
 #       endif
-        for(auto oarc:t->_oarcs) addtokens(oarc->_place, oarc->_wt);
+        for(unsigned i=_cn._tooff[t]; i<_cn._tooff[t+1]; i++)
+            deposit(_cn._toplace[i], _cn._towt[i] * n);
     }
     // Does json conversion actions that are common to places and transitions
     JsonMap* node2json(JsonFactory& jf, JsonMap& nodemap, PNNode* n, JsonKey& label_key)
@@ -342,22 +880,138 @@ protected:
 public:
     PNTransition* createTransition(string name)
     {
-        auto t = new PNTransition(name, this);
-        _transitions.insert(t);
+        assertNotFrozen(name);
+        auto t = _arena.make<PNTransition>(name, this);
+        _transitions.push_back(t);
+        _nodes.push_back(t);
         return t;
     }
     PNPlace* createPlace(string name, unsigned marking=0, unsigned capacity=1)
     {
-        auto p = new PNPlace(name, this, marking, capacity);
-        _places.insert(p);
+        assertNotFrozen(name);
+        auto p = _arena.make<PNPlace>(name, this, marking, capacity);
+        _places.push_back(p);
+        _nodes.push_back(p);
         return p;
     }
     PNQuitPlace* createQuitPlace(string name, unsigned marking=0, unsigned capacity=1)
     {
-        auto p = new PNQuitPlace(name, this, marking, capacity);
-        _places.insert(p);
+        assertNotFrozen(name);
+        auto p = _arena.make<PNQuitPlace>(name, this, marking, capacity);
+        _places.push_back(p);
+        _nodes.push_back(p);
         return p;
     }
+    // Bulk construction, for large nets. Nodes created together get
+    // consecutive node ids, the first one is returned. markings and
+    // capacities, if given, have an entry per place.
+    unsigned createPlaces(const vector<string>& names, const vector<unsigned>& markings = {}, const vector<unsigned>& capacities = {})
+    {
+        assertNotFrozen(names.empty() ? "" : names[0]);
+        unsigned first = _idcntr;
+        _places.reserve(_places.size() + names.size());
+        _nodes.reserve(_nodes.size() + names.size());
+        for(unsigned i=0; i<names.size(); i++)
+        {
+            auto p = _arena.make<PNPlace>(names[i], this, markings.empty() ? 0 : markings[i], capacities.empty() ? 1 : capacities[i]);
+            _places.push_back(p);
+            _nodes.push_back(p);
+        }
+        return first;
+    }
+    unsigned createTransitions(const vector<string>& names)
+    {
+        assertNotFrozen(names.empty() ? "" : names[0]);
+        unsigned first = _idcntr;
+        _transitions.reserve(_transitions.size() + names.size());
+        _nodes.reserve(_nodes.size() + names.size());
+        for(auto& name:names)
+        {
+            auto t = _arena.make<PNTransition>(name, this);
+            _transitions.push_back(t);
+            _nodes.push_back(t);
+        }
+        return first;
+    }
+    // Arcs between a place and a transition given by node ids. Unlike
+    // createArc, they are only recorded here and get checked (in one pass) and
+    // created when the net is frozen or printed, a bad arc exits then.
+    void createArcs(const vector<PNArcSpec>& arcs)
+    {
+        assertNotFrozen("arcs");
+        _pendingArcs.insert(_pendingArcs.end(), arcs.begin(), arcs.end());
+    }
+    PNNode* node(unsigned nodeid) { return _nodes[nodeid]; }
+    // Writes a binary image (see pnimage.h) of the net, freezing it: nodes
+    // with names, markings and capacities, arcs and the compiled arrays.
+    // Actions, arc choosers and delays are code, they aren't saved.
+    void saveImage(string filename)
+    {
+        freeze();
+        vector<PNImageNode> nodes;
+        string names;
+        for(auto n:_nodes)
+        {
+            PNImageNode in {PNImageNode::TRANSITION, 0, 0, (uint32_t) n->_name.size(), names.size()};
+            if ( n->typ() == PNElement::PLACE )
+            {
+                auto p = (PNPlace*) n;
+                in._kind = dynamic_cast<PNQuitPlace*>(p) ? PNImageNode::QUITPLACE : PNImageNode::PLACE;
+                in._marking = p->marking();
+                in._capacity = p->capacity();
+            }
+            nodes.push_back(in);
+            names += n->_name;
+        }
+        vector<PNArcSpec> arcs;
+        for(auto a:_arcs) arcs.push_back({a->source()->_nodeid, a->target()->_nodeid, a->_wt});
+        typedef PNImageHeader H;
+        PNImageWriter w(_places.size(), _transitions.size());
+        w.section(H::NODES, nodes.data(), nodes.size());
+        w.section(H::NAMES, names.data(), names.size());
+        w.section(H::ARCS, arcs.data(), arcs.size());
+        auto arr = [&](H::Section s, PNArray<unsigned>& a) { w.section(s, a.data(), a.size()); };
+        arr(H::TIOFF, _cn._tioff); arr(H::TIPLACE, _cn._tiplace); arr(H::TIWT, _cn._tiwt);
+        arr(H::TOOFF, _cn._tooff); arr(H::TOPLACE, _cn._toplace); arr(H::TOWT, _cn._towt);
+        arr(H::POOFF, _cn._pooff); arr(H::POTRANS, _cn._potrans); arr(H::POWT, _cn._powt);
+        arr(H::PIOFF, _cn._pioff); arr(H::PITRANS, _cn._pitrans); arr(H::PIWT, _cn._piwt);
+        w.write(filename);
+    }
+    // Builds the net saved by saveImage, on an empty net, and freezes it. The
+    // nodes get the same node ids and (with the arcs) the same order as in the
+    // saved net, the compiled arrays are used from the mapped image.
+    void loadImage(string filename)
+    {
+        assertNotFrozen(filename);
+        if ( not _nodes.empty() )
+        {
+            cout << "Net isn't empty, can't load: " << filename << endl;
+            exit(1);
+        }
+        _image.open(filename);
+        typedef PNImageHeader H;
+        auto nodes = _image.section<PNImageNode>(H::NODES);
+        auto names = _image.section<char>(H::NAMES);
+        _places.reserve(_image.header()._nplaces);
+        _transitions.reserve(_image.header()._ntransitions);
+        _nodes.reserve(_image.count(H::NODES));
+        for(uint64_t i=0; i<_image.count(H::NODES); i++)
+        {
+            auto& n = nodes[i];
+            if ( n._nameoff + n._namelen > _image.count(H::NAMES) )
+            {
+                cout << "PNImage : " << filename << " has a bad name of node " << i << endl;
+                exit(1);
+            }
+            string name(names + n._nameoff, n._namelen);
+            if ( n._kind == PNImageNode::TRANSITION ) createTransition(name);
+            else if ( n._kind == PNImageNode::QUITPLACE ) createQuitPlace(name, n._marking, n._capacity);
+            else createPlace(name, n._marking, n._capacity);
+        }
+        buildArcs(_image.section<PNArcSpec>(H::ARCS), _image.count(H::ARCS));
+        _cn.view(_places, _transitions, _image);
+        freeze();
+    }
     // returns intermediate node if it was inserted between PP/TT else NULL
     // adds the created arc(s) and intermediate node (if any) to Elements pnes
     // For intermediate node (if any i.e. for PP/TT arguments) optional
@@ -366,6 +1020,7 @@ public:
     // arguments i.e. only when a single arc is created
     PNNode* createArc(PNNode *n1, PNNode *n2, string name = "", unsigned wt = 1)
     {
+        assertNotFrozen(n1->_name + "->" + n2->_name);
         if ( n1->typ() == PNElement::TRANSITION )
         {
             assertTransitionPresent((PNTransition*)n1);
@@ -373,14 +1028,14 @@ public:
             {
                 assertTransitionPresent((PNTransition*)n2);
                 auto *dummy = createPlace(name);
-                _arcs.push_back(new PNTPArc((PNTransition*)n1,dummy));
-                _arcs.push_back(new PNPTArc(dummy,(PNTransition*)n2));
+                _arcs.push_back(_arena.make<PNTPArc>((PNTransition*)n1,dummy));
+                _arcs.push_back(_arena.make<PNPTArc>(dummy,(PNTransition*)n2));
                 return dummy;
             }
             else
             {
                 assertPlacePresent((PNPlace*)n2);
-                _arcs.push_back(new PNTPArc((PNTransition*)n1,(PNPlace*)n2,wt));
+                _arcs.push_back(_arena.make<PNTPArc>((PNTransition*)n1,(PNPlace*)n2,wt));
                 return NULL;
             }
         }
@@ -390,29 +1045,44 @@ public:
             if ( n2->typ() == PNElement::TRANSITION )
             {
                 assertTransitionPresent((PNTransition*)n2);
-                _arcs.push_back(new PNPTArc((PNPlace*)n1,(PNTransition*)n2,wt));
+                _arcs.push_back(_arena.make<PNPTArc>((PNPlace*)n1,(PNTransition*)n2,wt));
                 return NULL;
             }
             else
             {
                 assertPlacePresent((PNPlace*)n2);
                 auto *dummy = createTransition(name);
-                _arcs.push_back(new PNPTArc((PNPlace*)n1,dummy));
-                _arcs.push_back(new PNTPArc(dummy,(PNPlace*)n2));
+                _arcs.push_back(_arena.make<PNPTArc>((PNPlace*)n1,dummy));
+                _arcs.push_back(_arena.make<PNTPArc>(dummy,(PNPlace*)n2));
                 return dummy;
             }
         }
     }
+    static string xmlesc(const string& s)
+    {
+        string ret;
+        for(char c:s)
+        {
+            if ( c == '<' ) ret += "&lt;";
+            else if ( c == '>' ) ret += "&gt;";
+            else if ( c == '&' ) ret += "&amp;";
+            else if ( c == '"' ) ret += "&quot;";
+            else ret += c;
+        }
+        return ret;
+    }
     void printpnml(string filename="petri.pnml")
     {
+        buildPendingArcs();
         ofstream ofs;
         ofs.open(filename);
         ofs << "<?xml version=\"1.0\"?>" << endl;
         ofs << "<pnml xmlns=\"http://www.pnml.org/version-2009/grammar/pnml\">" << endl;
+        ofs << "<net id=\"" << xmlesc(_netname) << "\" type=\"http://www.pnml.org/version-2009/grammar/ptnet\"><page id=\"page0\">" << endl;
         for(auto p:_places)
         {
             ofs << "<place id=\"" << p->idstr() << "\">";
-            ofs << "<name><text>" << p->_name << "</text></name>";
+            ofs << "<name><text>" << xmlesc(p->_name) << "</text></name>";
             auto marking = p->marking();
             if( marking )
                 ofs << "<initialMarking><text>" << marking << "</text></initialMarking>";
@@ -421,18 +1091,24 @@ public:
         for(auto t:_transitions)
         {
             ofs << "<transition id=\"" << t->idstr() << "\">";
-            ofs << "<name><text>" << t->_name << "</text></name>";
+            ofs << "<name><text>" << xmlesc(t->_name) << "</text></name>";
             ofs << "</transition>" << endl;
         }
         unsigned tmparcid=0;
         for(auto e:_arcs)
-            ofs << "<arc id=\"" << tmparcid++ << "\" source=\"" << e->source()->idstr() << "\" target=\"" << e->target()->idstr() << "\"/>" << endl;
+        {
+            ofs << "<arc id=\"a" << tmparcid++ << "\" source=\"" << e->source()->idstr() << "\" target=\"" << e->target()->idstr() << "\"";
+            if ( e->_wt != 1 ) ofs << "><inscription><text>" << e->_wt << "</text></inscription></arc>" << endl;
+            else ofs << "/>" << endl;
+        }
+        ofs << "</page></net>" << endl;
         ofs << "</pnml>" << endl;
         ofs.close();
     }
 
     void printjson(ofstream& ofs)
     {
+        buildPendingArcs();
         JSONSTR(label)
         JSONSTR(places)
         JSONSTR(transitions)
@@ -488,6 +1164,7 @@ public:
     }
     void printdot(string filename="petri.dot")
     {
+        buildPendingArcs();
         DNodeList nl;
         for(auto n:_places) nl.push_back(n->dnode());
         for(auto n:_transitions) nl.push_back(n->dnode());
@@ -498,21 +1175,57 @@ public:
     }
     void printMarkings()
     {
-        for(auto p:_places) if ( p->_tokens )
-            cout << "MARKING:" << p->idlabel() << ":" << p->_tokens << endl;
+        for(auto p:_places) if ( p->tokens() )
+            cout << "MARKING:" << p->idlabel() << ":" << p->tokens() << endl;
     }
 
-    // Convenience API to find and delete all elements (places, transitions,
-    // arcs). Responsibility to delete is with one who does new (all
-    // destructors are virtual)
+    // Deletes all elements (places, transitions, arcs), which live in the
+    // net's arena. Node destructors are run since callbacks may own state,
+    // arcs own nothing, then all the memory is released in one go.
     void deleteElems()
     {
-        for(auto n:_places) delete n;
-        for(auto n:_transitions) delete n;
-        for(auto e:_arcs) delete e;
+        for(auto n:_places) n->~PNPlace();
+        for(auto n:_transitions) n->~PNTransition();
+        _places.clear();
+        _transitions.clear();
+        _nodes.clear();
+        _arcs.clear();
+        _pendingArcs.clear();
+        _arena.release();
+        _names.clear();
+    }
+    // Compiles the net structure into flat arrays which the simulation works
+    // on. No places, transitions or arcs can be added thereafter. Called by
+    // init or by the first addtokens, whichever is earlier.
+    void freeze()
+    {
+        call_once(_freezeonce, [this]()
+        {
+            buildPendingArcs();
+            // Already viewing the arrays of an image for a loaded net
+            if ( _cn._tioff.empty() ) _cn.compile(_places, _transitions);
+            _tokens = vector<PNCount>(_placecntr);
+#           ifdef PNDBG
+            _pnlog.start(_cn.nodeNames(), _cn.nplaces());
+#           endif
+            _postfreeze();
+            _frozen = true;
+        });
+    }
+    // Read only access to the compiled structure, e.g. for running replicas
+    PNCompiledNet& compiled()
+    {
+        freeze();
+        return _cn;
+    }
+    void addtokens(PNPlace* place, unsigned newtokens)
+    {
+        freeze();
+        deposit(place->_idx, newtokens);
     }
     void init()
     {
+        freeze();
         for(auto p:_places)
             if ( p->marking() )
                 addtokens(p, p->marking());
@@ -526,208 +1239,392 @@ public:
 class MTPetriNet : public PetriNetBase
 {
 using PetriNetBase::PetriNetBase;
+    // Number of input places of a transition having enough tokens
+    vector<PNCount> _enabledPlaceCnt;
+#   ifndef PN_ATOMIC_TOKENS
+    vector<mutex> _enabledPlaceCntMutex;
+    vector<mutex> _placemutex;
+#   endif
+    unsigned _maxbatch = 1; // see setBatchFiring
+    bool _affinity = false; // see setAffinity
+    vector<unsigned> _owner; // worker of each transition, with affinity
+#   ifdef PN_ATOMIC_TOKENS
+    inline static thread_local bool _reenabled = false; // see tryTrigger
+#   endif
+    void _postfreeze()
+    {
+        _enabledPlaceCnt = vector<PNCount>(_cn.ntransitions());
+#       ifndef PN_ATOMIC_TOKENS
+        _enabledPlaceCntMutex = vector<mutex>(_cn.ntransitions());
+        _placemutex = vector<mutex>(_cn.nplaces());
+#       endif
+        if ( _affinity and nthreads() > 1 ) partition();
+    }
+    void partition()
+    {
+        _owner = _cn.partition(nthreads());
+        cout << "MTPetriNet : affinity over " << nthreads() << " workers, " << _cn.sharedPlaces(_owner)
+             << " of " << _cn.nplaces() << " places shared" << endl;
+    }
+    bool hasEnabledPlaces(unsigned t) { return _enabledPlaceCnt[t] == _cn.ninputs(t); }
+    typedef enum {TRYTRIGGER} Op;
+    void schedule(unsigned t)
+    {
+        if ( _owner.empty() ) addtask(TRYTRIGGER, t);
+        else addtask(TRYTRIGGER, t, _owner[t]);
+    }
+    void runTask(unsigned op, unsigned t) { tryTrigger(t); }
 
 // Transition methods (See Design note)
-    void tryTrigger(PNTransition *transition)
+    // Although tryTrigger is called only when preceding places have enough
+    // tokens, there can be other contenders for those tokens who may consume
+    // them, hence we need to check again whether this transition can fire by
+    // holding all predecessor places' counts under a lock
+    //
+    // With PN_ATOMIC_TOKENS a failed pass isn't retried: the contender
+    // holding the missing tokens either fires or restores them, which
+    // schedules t again. Only when t's own restore made its inputs whole
+    // (which schedules nothing, see restore) is it retried at once.
+    void tryTrigger(unsigned t)
     {
-        Arcs::iterator it = transition->_iarcs.begin();
-        while(transition->hasEnabledPlaces())
-            if(tryTransferTokens(transition,it)) fire(transition);
+        while(hasEnabledPlaces(t))
+        {
+            unsigned n = _maxbatch;
+#           ifdef PN_ATOMIC_TOKENS
+            _reenabled = false;
+#           endif
+            if(tryTransferTokens(t,_cn._tioff[t],n)) fire(t,n);
+            else
+            {
+                countStat(FAILEDTRIGGERS);
+#               ifdef PN_ATOMIC_TOKENS
+                if(not _reenabled) break;
+#               endif
+            }
+        }
     }
     // Recursive walk helps keep it simple to avoid locking input places in
-    // case previous ones do not meet the criteria
-    bool tryTransferTokens(PNTransition* transition, Arcs::iterator it)
+    // case previous ones do not meet the criteria. Input places are sorted by
+    // index, so all transitions lock them in the same order.
+    //
+    // n is the number of firings wanted, it is lowered to what the input
+    // places allow (tokens / weight) as they are locked, and that many times
+    // the weights are deducted.
+    //
+    // With PN_ATOMIC_TOKENS, tokens are reserved (deducted by CAS) from input
+    // places in the same order instead of locking them, and the ones reserved
+    // so far are returned if a later place falls short (or allows fewer
+    // firings).
+    bool tryTransferTokens(unsigned t, unsigned i, unsigned& n)
     {
-        if(it==transition->_iarcs.end()) return true;
-        auto ptarc = *it;
-        if(ptarc->_place->lockIfEnough(ptarc->_wt))
+        if(i==_cn._tioff[t+1]) return true;
+        unsigned p = _cn._tiplace[i], wt = _cn._tiwt[i];
+#       ifdef PN_ATOMIC_TOKENS
+        unsigned reserved = reserve(p,wt,n);
+        if(reserved == 0) return false;
+        n = reserved;
+        if(tryTransferTokens(t,i+1,n))
         {
-            if(tryTransferTokens(transition,++it))
+            if(reserved > n) restore(p,wt*(reserved-n),t);
+            return true;
+        }
+        restore(p,wt*reserved,t);
+        return false;
+#       else
+        if(lockIfEnough(p,wt))
+        {
+            n = min(n, (unsigned) _tokens[p] / wt);
+            if(tryTransferTokens(t,i+1,n))
             {
-                deducttokens(ptarc->_place, ptarc->_wt);
-                ptarc->_place->unlock();
+                deducttokens(p,wt*n);
+                _placemutex[p].unlock();
                 return true;
             }
             else
             {
-                ptarc->_place->unlock();
+                _placemutex[p].unlock();
                 return false;
             }
         }
         else return false;
+#       endif
+    }
+#   ifdef PN_ATOMIC_TOKENS
+    // Counts are updated in the order in which threads detect the threshold
+    // crossings, which needn't be the order of the crossings. So a count may
+    // transiently overshoot (or wrap below 0) and the transition is scheduled
+    // whenever the count reaches the number of inputs from either side. Every
+    // crossing is counted, hence the count settles to the right value; an arc
+    // chooser only limits which crossings may schedule the transition.
+    //
+    // Returns whether the count reached the number of inputs.
+    bool gotEnoughTokens(unsigned t, bool eligible=true)
+    {
+        if(++_enabledPlaceCnt[t] == _cn.ninputs(t))
+        {
+            if ( eligible ) schedule(t);
+            return true;
+        }
+        _cn._transitions[t]->notEnoughTokensActions();
+        return false;
+    }
+    void notEnoughTokens(unsigned t)
+    {
+        if(--_enabledPlaceCnt[t] == _cn.ninputs(t)) schedule(t);
     }
-    void gotEnoughTokens(PNTransition* transition)
+#   else
+    void gotEnoughTokens(unsigned t)
     {
-        transition->_enabledPlaceCntMutex.lock();
-        transition->_enabledPlaceCnt++;
-        Work tryTriggerWrok = bind(&MTPetriNet::tryTrigger,this,transition);
-        if(transition->hasEnabledPlaces()) addwork(tryTriggerWrok);
-        else transition->notEnoughTokensActions();
-        transition->_enabledPlaceCntMutex.unlock();
+        countedLock(_enabledPlaceCntMutex[t]);
+        _enabledPlaceCnt[t]++;
+        if(hasEnabledPlaces(t)) schedule(t);
+        else _cn._transitions[t]->notEnoughTokensActions();
+        _enabledPlaceCntMutex[t].unlock();
     }
-    void notEnoughTokens(PNTransition* transition)
+    void notEnoughTokens(unsigned t)
     {
-        transition->_enabledPlaceCntMutex.lock();
-        if( transition->_enabledPlaceCnt > 0 ) transition->_enabledPlaceCnt--;
-        transition->_enabledPlaceCntMutex.unlock();
+        countedLock(_enabledPlaceCntMutex[t]);
+        if( _enabledPlaceCnt[t] > 0 ) _enabledPlaceCnt[t]--;
+        _enabledPlaceCntMutex[t].unlock();
     }
+#   endif
 // Place methods (See Design note)
+    // inform the transitions only if we went below their threshold now
+    void notifyDeducted(unsigned p, unsigned oldcnt, unsigned newcnt)
+    {
+        _cn.forCrossedArcs(p, newcnt, oldcnt, [&](unsigned i){ notEnoughTokens(_cn._potrans[i]); });
+    }
+#   ifdef PN_ATOMIC_TOKENS
+    // Reserves wt tokens up to n times, as many as there are, returns how
+    // many
+    unsigned reserve(unsigned p, unsigned wt, unsigned n)
+    {
+        unsigned oldcnt = _tokens[p], k;
+        while ( true )
+        {
+            k = min(n, oldcnt / wt);
+            if ( k == 0 ) return 0;
+            if ( _tokens[p].compare_exchange_weak(oldcnt, oldcnt-k*wt) ) break;
+            countStat(CASRETRIES);
+        }
+        notifyDeducted(p, oldcnt, oldcnt-k*wt);
+        return k;
+    }
+    // Undoes reserve of transition self, so all (not just eligible) arcs are
+    // informed. self isn't scheduled, it's backing off, but if this made its
+    // inputs whole _reenabled tells tryTrigger to retry.
+    void restore(unsigned p, unsigned tokens, unsigned self)
+    {
+        unsigned oldcnt = _tokens[p].fetch_add(tokens);
+        _cn.forCrossedArcs(p, oldcnt, oldcnt+tokens, [&](unsigned i)
+        {
+            unsigned t = _cn._potrans[i];
+            if(gotEnoughTokens(t, t != self) and t == self) _reenabled = true;
+        });
+    }
+#   else
+    bool lockIfEnough(unsigned p, unsigned mintokens)
+    {
+        countedLock(_placemutex[p]);
+        if(_tokens[p] >= mintokens) return true;
+        else
+        {
+            _placemutex[p].unlock();
+            return false;
+        }
+    }
     // deducttokens Expects caller to have taken care of locking
-    void deducttokens(PNPlace* place, unsigned tokens)
+    void deducttokens(unsigned p, unsigned tokens)
     {
-        unsigned oldcnt = place->_tokens;
-        place->_tokens -= tokens;
-        for(auto oarc:place->_oarcs)
-            // inform the transition only if we went below the threshold now
-            if( place->_tokens < oarc->_wt && oldcnt >= oarc->_wt )
-                notEnoughTokens((PNTransition*)oarc->_transition);
+        unsigned oldcnt = _tokens[p];
+        _tokens[p] -= tokens;
+        notifyDeducted(p, oldcnt, _tokens[p]);
     }
-public:
-    void addtokens(PNPlace* place, unsigned newtokens)
+#   endif
+    void deposit(unsigned p, unsigned newtokens)
     {
-        Arcs eligibleArcs = place->eligibleArcs();
-        place->lock();
-        unsigned oldcnt = place->_tokens;
-        place->_tokens += newtokens;
+#       ifdef PN_ATOMIC_TOKENS
+        unsigned oldcnt = _tokens[p].fetch_add(newtokens);
+#       else
+        countedLock(_placemutex[p]);
+        unsigned oldcnt = _tokens[p];
+        _tokens[p] += newtokens;
+#       endif
+        unsigned newcnt = oldcnt + newtokens;
 #       ifdef PN_PLACE_CAPACITY_EXCEPTION
-        checkPlaceCapacityException(place);
+        checkPlaceCapacityException(p);
+#       endif
+        // inform the transition only if we crossed the threshold now
+        // Think, whether we want to randomize the sequence of oarc for non
+        // determinism Of course, without it also the behavior is correct,
+        // since a deterministic sequence is a subset of possible non
+        // deterministic behaviors anyway.
+        bool chooser = _cn._places[p]->hasArcChooser();
+#       ifdef PN_ATOMIC_TOKENS
+        _cn.forCrossedArcs(p, oldcnt, newcnt, [&](unsigned i)
+        {
+            gotEnoughTokens(_cn._potrans[i], not chooser);
+        });
+        if ( chooser )
+            _cn.forEligibleArcs(p, [&](unsigned i)
+            {
+                auto t = _cn._potrans[i];
+                if( newcnt >= _cn._powt[i] && oldcnt < _cn._powt[i] && hasEnabledPlaces(t) )
+                    schedule(t);
+            });
+#       else
+        if ( chooser )
+            _cn.forEligibleArcs(p, [&](unsigned i)
+            {
+                if( newcnt >= _cn._powt[i] && oldcnt < _cn._powt[i] )
+                    gotEnoughTokens(_cn._potrans[i]);
+            });
+        else _cn.forCrossedArcs(p, oldcnt, newcnt, [&](unsigned i){ gotEnoughTokens(_cn._potrans[i]); });
+        _placemutex[p].unlock();
 #       endif
-        for(auto oarc:eligibleArcs)
-            // inform the transition only if we crossed the threshold now
-            // Think, whether we want to randomize the sequence of oarc for non
-            // determinism Of course, without it also the behavior is correct,
-            // since a deterministic sequence is a subset of possible non
-            // deterministic behaviors anyway.
-            if( place->_tokens >= oarc->_wt && oldcnt < oarc->_wt )
-                gotEnoughTokens((PNTransition*)oarc->_transition);
-        place->unlock();
-        place->addactions(newtokens);
+        _cn._places[p]->addactions(newtokens);
     }
+public:
+    // A transition whose input places hold tokens for several firings fires
+    // up to maxbatch times in one pass: the inputs are locked (or reserved)
+    // once, the enabled actions run for each firing and the outputs get all
+    // the tokens in one deposit, i.e. add actions run once for the batch.
+    // Default 1, i.e. a firing at a time. Batches let a transition take all
+    // the tokens of a shared place at once, starving its competitors for that
+    // long, maxbatch bounds it.
+    void setBatchFiring(unsigned maxbatch = UINT_MAX) { _maxbatch = max(maxbatch, 1u); }
+    // Partitions the transitions over the worker threads when the net is
+    // frozen (see PNCompiledNet::partition) and runs the firings of a
+    // transition on its owner, so that the places (their locks and counts)
+    // of a part stay in one core's cache and only places shared by parts
+    // move between cores. A busy worker's firings are still stolen by idle
+    // ones. Call before the net is frozen, has no effect with 1 thread.
+    void setAffinity(bool affinity = true) { _affinity = affinity; }
+    ~MTPetriNet() { shutdown(); }
 };
 
-// TODO: Decide how to use multiple cores for STPN. Either start multiple
-// simulations over threads or let the user start multiple processes. Log
-// clashes should be avoided when doing so.
+// For using multiple cores, many seeded simulations of a net can be run over
+// threads by STPetriNetBatch (see pnbatch.h), each replica writes its own log.
 class STPetriNet : public PetriNetBase
 {
 using PetriNetBase::PetriNetBase;
-using t_pair  = pair<double, PNTransition*>;
-    // Saves the overhead of comparing 2nd member of the pair
-    class PriorityLT
-    {
-    public:
-        // Since delay is opposite of priority, we use >
-        bool operator() (t_pair& l, t_pair& r) { return l.first > r.first; }
-    };
-using t_queue = priority_queue<t_pair, vector<t_pair>, PriorityLT>;
-
 #ifdef SIMU_MODE_RANDOMPICK
-    list<PNTransition*> _tq;
-    random_device _rng;
-    uniform_int_distribution<unsigned> _udistr;
-#elif defined ( SIMU_MODE_RANDOMPRIO )
-    t_queue _tq;
-    random_device _rng;
-    uniform_real_distribution<double> _udistr {-1,1};
+    PNMarking<PNIndexedSet,PNCount> _m;
 #else
-    t_queue _tq;
+    // Since delay is opposite of priority, the least key fires first
+    PNMarking<PNIndexedHeap,PNCount> _m;
+#endif
+#if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_RANDOMPRIO )
+    PNRandom _rng;
 #endif
 
 #ifdef SIMU_MODE_STPN
     double _offset = 0;
 #endif
-    mutex _tqmutex;
-    condition_variable _tq_cvar;
+    // Tokens and _m are touched only by the thread running simuloop, hence
+    // without any locks. Tokens added from other threads (e.g. by actions
+    // running elsewhere, or init) are passed via _inbox.
+    PNInbox<pair<unsigned,unsigned>> _inbox;
+    atomic<bool> _looping {false}; // simuloop is queued or running
+    // Set by init once all initial tokens are in _inbox, so that the loop
+    // doesn't start firing from a partial initial marking
+    atomic<bool> _started {false};
+    inline static thread_local STPetriNet *_tlnet = nullptr; // net whose simuloop runs on this thread
 
-    void _simuloop()
+    void _postfreeze() { _m.init(_cn, _tokens); }
+    void _postinit()
+    {
+        _started = true;
+        if ( not _looping.exchange(true) ) addtask(SIMULOOP, 0);
+    }
+    // (Re)enqueues t with a fresh priority
+    void enqueue(unsigned t)
     {
+#if defined( SIMU_MODE_RANDOMPICK )
+        _m._tq.insert(t);
+#elif defined( SIMU_MODE_RANDOMPRIO )
+        _m._tq.set(t, _rng.uniform(-1,1));
+#elif defined( SIMU_MODE_STPN )
+        _m._tq.set(t, _cn._transitions[t]->delay() + _offset);
+#else
+        _m._tq.set(t, _cn._transitions[t]->delay());
+#endif
+    }
+
+    typedef enum {SIMULOOP} Op;
+    void runTask(unsigned op, unsigned arg) { simuloop(); }
+    // Runs as a work item till _m and _inbox drain, deposit schedules it
+    // again when tokens arrive later
+    void simuloop()
+    {
+        _tlnet = this;
         while ( not _quit )
         {
-            _tqmutex.lock();
-            if ( _tq.empty() )
+            if ( not _inbox.empty() )
+                _inbox.drain([&](pair<unsigned,unsigned>& d) { apply(d.first, d.second); });
+            if ( _m._tq.empty() )
             {
-                _tqmutex.unlock();
-                break;
+                // A depositor that found _looping set has pushed to _inbox
+                // before, hence recheck it after clearing _looping
+                _looping = false;
+                if ( _inbox.empty() or _looping.exchange(true) ) break;
+                continue;
             }
-#ifdef SIMU_MODE_STPN
-            _offset += _tq.top().first;
-#endif
-
 #ifdef SIMU_MODE_RANDOMPICK
-            int pick = _udistr(_rng) % _tq.size();
-            auto it = _tq.begin();
-            advance(it,pick);
-            auto t = *it;
-            _tq.erase(it);
+            auto t = _m._tq.at(_rng.below(_m._tq.size()));
 #else
-            auto t = _tq.top().second;
-            _tq.pop();
+            auto t = _m._tq.top();
+#   ifdef SIMU_MODE_STPN
+            _offset = _m._tq.topkey();
+#   endif
 #endif
-            _tqmutex.unlock();
-            // this was checked when adding to _tq, but marking may change
-            // till its turn comes, so check again
-            if ( t->mayFire() )
-            {
-                for(auto ia:t->_iarcs)
-                {
-                    auto p = ia->_place;
-                    p->lock();
-                    p->_tokens -= ia->_wt;
-                    p->unlock();
-                }
-                fire(t);
-            }
+            for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+                _m.take(_cn._tiplace[i], _cn._tiwt[i]);
+            fire(t);
+            // Enough tokens for another round is a fresh enabling as far as
+            // the priority goes
+            if ( _m.enabled(t) ) enqueue(t);
         }
+        _tlnet = nullptr;
     }
-    void simuloop()
+#if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_RANDOMPRIO )
+    void reportSeed() { cout << "STPetriNet : seed set to " << _rng.getSeed() << endl; }
+#endif
+    void apply(unsigned p, unsigned newtokens)
     {
-        // TODO: this needs to be a do-while loop, otherwise and early quit will exit
-        // TODO: wait call lambda should be not _tq.empty()
-        // TODO: unique_lock and wait should be in a scope (braces)
-        while ( not _quit )
+        _m.add(p, newtokens, [&](unsigned t) { enqueue(t); });
+        _cn._places[p]->addactions(newtokens);
+    }
+    // Deposits from fired transitions and their actions are applied right
+    // away. Others are queued and applied by simuloop, so their add actions
+    // run on its thread. Till init is done they are only queued.
+    void deposit(unsigned p, unsigned newtokens)
+    {
+        if ( _tlnet == this ) apply(p, newtokens);
+        else
         {
-            _simuloop();
-            unique_lock<mutex> ulockq(_tqmutex);
-            _tq_cvar.wait(ulockq, [](){return true;});
+            _inbox.push({p, newtokens});
+            if ( _started and not _looping.exchange(true) ) addtask(SIMULOOP, 0);
         }
     }
-    void _postinit()
+public:
+#if defined( SIMU_MODE_RANDOMPICK ) || defined( SIMU_MODE_RANDOMPRIO )
+    // Seed is taken from PNSEED environment variable (else is non
+    // deterministic) and is printed, passing the same seed here or in PNSEED
+    // replays a run, over any number of threads, as the loop fires from the
+    // whole initial marking. Call before any tokens are added.
+    void setSeed(unsigned long seed)
     {
-        Work w = bind(&STPetriNet::simuloop,this);
-        addwork(w);
+        _rng.seed(seed);
+        reportSeed();
     }
-public:
-    void addtokens(PNPlace* place, unsigned newtokens)
+    STPetriNet(string netname = "system", function<void(unsigned, unsigned long)> eventListener = [](unsigned, unsigned long){})
+        : PetriNetBase(netname, eventListener)
     {
-        place->lock();
-        place->_tokens += newtokens;
-#       ifdef PN_PLACE_CAPACITY_EXCEPTION
-        checkPlaceCapacityException(place);
-#       endif
-        place->unlock();
-        place->addactions(newtokens);
-        Arcs eligibleArcs = place->eligibleArcs();
-        for(auto oarc:eligibleArcs)
-        {
-            auto t = oarc->_transition;
-            if ( t->mayFire() )
-            {
-                _tqmutex.lock();
-#if defined( SIMU_MODE_RANDOMPICK )
-                _tq.push_back(t);
-#elif defined( SIMU_MODE_RANDOMPRIO )
-                _tq.push( { _udistr(_rng), t } );
-#elif defined( SIMU_MODE_STPN )
-                _tq.push( { t->delay() + _offset, t } );
-#else
-                _tq.push( { t->delay(), t } );
-#endif
-                _tqmutex.unlock();
-            }
-        }
-        unique_lock<mutex> ulockq(_tqmutex);
-        _tq_cvar.notify_one();
+        reportSeed();
     }
+#endif
+    ~STPetriNet() { shutdown(); }
 };
 
 #endif
@@ -0,0 +1,107 @@
+#ifndef _PNARENA_H
+#define _PNARENA_H
+
+// Storage for the elements of a net. Places, transitions and arcs are
+// carved out of large blocks in creation order, so that a net of millions of
+// elements takes few allocations, sits contiguous in memory and is freed by
+// releasing the blocks. Node names are interned in a string table.
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <new>
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+// Bump allocator. Objects are never freed one by one, release frees them
+// all without running destructors, the owner runs those that matter.
+class PNArena
+{
+    static constexpr size_t BLOCKSIZE = 1 << 20;
+    vector<char*> _blocks;
+    char *_cur = nullptr;
+    size_t _left = 0;
+
+    void* alloc(size_t size, size_t align)
+    {
+        size_t pad = ( align - (size_t) _cur % align ) % align;
+        if ( _cur == nullptr or pad + size > _left )
+        {
+            size_t blocksize = max(BLOCKSIZE, size + align);
+            _cur = (char*) malloc(blocksize);
+            if ( _cur == nullptr )
+            {
+                cout << "PNArena : out of memory" << endl;
+                exit(1);
+            }
+            _blocks.push_back(_cur);
+            _left = blocksize;
+            pad = ( align - (size_t) _cur % align ) % align;
+        }
+        void *ret = _cur + pad;
+        _cur += pad + size;
+        _left -= pad + size;
+        return ret;
+    }
+public:
+    template<typename T, typename... A> T* make(A&&... args)
+    {
+        return new(alloc(sizeof(T), alignof(T))) T(forward<A>(args)...);
+    }
+    void release()
+    {
+        for(auto b:_blocks) free(b);
+        _blocks.clear();
+        _cur = nullptr;
+        _left = 0;
+    }
+    PNArena() {}
+    PNArena(const PNArena&) = delete;
+    ~PNArena() { release(); }
+};
+
+// Each distinct name is stored once, the references handed out stay valid
+// till clear. The index is an open addressing table of positions in _names.
+class PNNames
+{
+    deque<string> _names;
+    vector<size_t> _hashes; // of _names
+    vector<unsigned> _slots = vector<unsigned>(1024, 0); // position + 1, 0 if free
+
+    void grow()
+    {
+        _slots.assign(_slots.size() * 2, 0);
+        size_t mask = _slots.size() - 1;
+        for(unsigned i=0; i<_names.size(); i++)
+        {
+            size_t s = _hashes[i] & mask;
+            while ( _slots[s] ) s = (s+1) & mask;
+            _slots[s] = i + 1;
+        }
+    }
+public:
+    const string& intern(const string& name)
+    {
+        size_t h = hash<string_view>()(name), mask = _slots.size() - 1;
+        size_t s = h & mask;
+        for(; _slots[s]; s = (s+1) & mask)
+            if ( _hashes[_slots[s]-1] == h and _names[_slots[s]-1] == name ) return _names[_slots[s]-1];
+        _names.push_back(name);
+        _hashes.push_back(h);
+        _slots[s] = _names.size();
+        if ( _names.size() * 2 > _slots.size() ) grow();
+        return _names.back();
+    }
+    void clear()
+    {
+        _names.clear();
+        _hashes.clear();
+        _slots.assign(1024, 0);
+    }
+};
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef _PNBATCH_H
+#define _PNBATCH_H
+
+// Runs many randomized simulations (replicas) of one net across a thread pool.
+//
+// The net is built and frozen once, all replicas share its compiled structure
+// read only and clone only the marking. Each replica follows the
+// SIMU_MODE_RANDOMPRIO policy of STPetriNet: a transition gets a uniform
+// random priority as soon as it gets enabled, the one with highest priority
+// fires first. Replica r is seeded from (seed, r), hence a batch is
+// reproducible and any single run can be replayed by its seed.
+//
+// Replicas fire by the rules of STPetriNet (see PNMarking), arc choosers and
+// capacity checks included, so arc choosers are called concurrently by
+// replicas. Otherwise they simulate the bare net: enabled actions, add
+// actions, delay functions and the event listener of the net are not
+// invoked, since replicas run concurrently. With PNDBG, rerun writes the log of the run to
+// <netname>.rerun.petri.bin (see pnlog.h), and after setLogReplicas(true)
+// each replica of run writes its own <netname>.<replica>.petri.bin.
+
+#include <vector>
+#include "petrinet.h"
+#include "pnrandom.h"
+
+class PNRunResult
+{
+public:
+    typedef enum {DEAD,QUIT,LIMIT} Status;
+    Status _status = DEAD;
+    unsigned long _seed = 0;
+    unsigned long _firings = 0;
+    vector<unsigned> _marking;
+    string statusstr()
+    {
+        switch(_status)
+        {
+            case DEAD : return "DEAD";
+            case QUIT : return "QUIT";
+            default   : return "LIMIT";
+        }
+    }
+};
+
+class STReplica
+{
+    PNCompiledNet& _cn;
+    vector<unsigned> _tokens;
+    PNMarking<PNIndexedHeap,unsigned> _m; // as STPetriNet's
+    PNRandom _rng;
+    bool _quit = false;
+#ifdef PNDBG
+    PNLogger *_log = NULL; // unless not logging
+#endif
+    // (Re)enqueues t with a fresh priority
+    void enqueue(unsigned t) { _m._tq.set(t, _rng.uniform(-1,1)); }
+    void deposit(unsigned p, unsigned newtokens)
+    {
+        _m.add(p, newtokens, [&](unsigned t) { enqueue(t); });
+#ifdef PNDBG
+        if ( _log ) _log->log(PNLogRecord::ADD, _cn._places[p]->_nodeid, newtokens, _tokens[p], 0);
+#endif
+        if ( _cn._isquit[p] ) _quit = true;
+    }
+    void deduct(unsigned p, unsigned tokens)
+    {
+        _m.take(p, tokens);
+#ifdef PNDBG
+        if ( _log ) _log->log(PNLogRecord::DEDUCT, _cn._places[p]->_nodeid, tokens, _tokens[p], 0);
+#endif
+    }
+public:
+    void run(PNRunResult& result, unsigned long maxfirings)
+    {
+        for(unsigned p=0; p<_tokens.size(); p++)
+        {
+            unsigned m = _tokens[p];
+            _tokens[p] = 0;
+            if ( m ) deposit(p, m);
+        }
+        unsigned long firings = 0;
+        while ( not _quit and not _m._tq.empty() and firings < maxfirings )
+        {
+            auto t = _m._tq.top();
+            for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+                deduct(_cn._tiplace[i], _cn._tiwt[i]);
+#ifdef PNDBG
+            if ( _log ) _log->log(PNLogRecord::FIRE, _cn._transitions[t]->_nodeid, 0, 0, firings);
+#endif
+            firings++;
+            for(unsigned i=_cn._tooff[t]; i<_cn._tooff[t+1]; i++)
+                deposit(_cn._toplace[i], _cn._towt[i]);
+            // Enough tokens for another round, a fresh enabling as far as
+            // the priority goes
+            if ( _m.enabled(t) ) enqueue(t);
+        }
+        result._status = _quit ? PNRunResult::QUIT :
+            firings >= maxfirings ? PNRunResult::LIMIT : PNRunResult::DEAD;
+        result._firings = firings;
+        result._marking = _tokens;
+    }
+    // Logs to logfile with PNDBG, unless it's empty
+    STReplica(PNCompiledNet& cn, vector<unsigned>& m0, unsigned long seed, string logfile) :
+        _cn(cn), _tokens(m0), _rng(seed)
+    {
+        _m.init(_cn, _tokens);
+#ifdef PNDBG
+        if ( logfile.empty() ) return;
+        _log = new PNLogger();
+        _log->open(logfile);
+        _log->start(_cn.nodeNames(), _cn.nplaces());
+#endif
+    }
+#ifdef PNDBG
+    ~STReplica() { delete _log; }
+#endif
+};
+
+// Single use: construct, then call run once. NTHREADS decides the pool size
+// as for any MTEngine.
+class STPetriNetBatch : public MTEngine
+{
+    PNCompiledNet& _cn;
+    string _netname;
+    vector<unsigned> _m0;
+    vector<PNRunResult> _results;
+    unsigned long _maxfirings;
+    bool _logreplicas = false;
+
+    void runReplica(unsigned r)
+    {
+        auto& result = _results[r];
+        STReplica replica(_cn, _m0, result._seed, _logreplicas ? _netname + "." + to_string(r) + ".petri.bin" : "");
+        replica.run(result, _maxfirings);
+    }
+    void runTask(unsigned op, unsigned r) { runReplica(r); }
+public:
+    static unsigned long replicaSeed(unsigned long seed, unsigned r)
+    {
+        // r-th splitmix64 output, so that adjacent replicas get unrelated streams
+        uint64_t x = seed + r * 0x9E3779B97F4A7C15UL;
+        return PNRandom::splitmix64(x);
+    }
+    // Runs nruns replicas, each till the net is dead, a quit place gets a
+    // token or maxfirings transitions have fired
+    vector<PNRunResult>& run(unsigned nruns, unsigned long seed=0, unsigned long maxfirings=1000000)
+    {
+        _maxfirings = maxfirings;
+        _results.resize(nruns);
+        for(unsigned r=0; r<nruns; r++)
+        {
+            _results[r]._seed = replicaSeed(seed, r);
+            addtask(0, r);
+        }
+        wait();
+        return _results;
+    }
+    // Reruns a single replica in the calling thread, e.g. with the _seed of a
+    // failing run
+    PNRunResult rerun(unsigned long replicaseed, unsigned long maxfirings=1000000)
+    {
+        PNRunResult result;
+        result._seed = replicaseed;
+        STReplica replica(_cn, _m0, replicaseed, _netname + ".rerun.petri.bin");
+        replica.run(result, maxfirings);
+        return result;
+    }
+    // With PNDBG, makes each replica of run write its own log (off by default,
+    // a batch would leave as many files and draining threads). rerun always
+    // logs.
+    void setLogReplicas(bool logreplicas) { _logreplicas = logreplicas; }
+    // Replicas start from the initial markings of places, unless given a
+    // marking (indexed by PNPlace::_idx) here
+    void setInitialMarking(vector<unsigned>& m0) { _m0 = m0; }
+    STPetriNetBatch(PetriNetBase& pn) : _cn(pn.compiled()), _netname(pn._netname)
+    {
+        for(auto p:_cn._places) _m0.push_back(p->marking());
+    }
+    ~STPetriNetBatch() { shutdown(); }
+};
+
+#endif
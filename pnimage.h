@@ -0,0 +1,143 @@
+#ifndef _PNIMAGE_H
+#define _PNIMAGE_H
+
+// Binary image of a frozen net, see PetriNetBase::saveImage and loadImage.
+//
+// Layout (native endianness): a PNImageHeader, whose section table gives the
+// offset (8 byte aligned) and element count of each section. The sections
+// are the node table (PNImageNode per node id), the names (concatenated, no
+// terminators), the arcs in creation order (source and target node id and
+// weight) and the arrays of the compiled net. The image is mapped and used
+// in place: the compiled arrays are viewed, not copied.
+//
+// The version is bumped on any layout change, images of another version are
+// refused.
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+class PNImageNode
+{
+public:
+    typedef enum {PLACE,QUITPLACE,TRANSITION} Kind;
+    uint32_t _kind;
+    uint32_t _marking;
+    uint32_t _capacity;
+    uint32_t _namelen;
+    uint64_t _nameoff;
+};
+
+class PNImageSection
+{
+public:
+    uint64_t _off;
+    uint64_t _count;
+};
+
+class PNImageHeader
+{
+public:
+    static constexpr uint32_t VERSION = 1;
+    typedef enum {NODES,NAMES,ARCS,
+                  TIOFF,TIPLACE,TIWT,TOOFF,TOPLACE,TOWT,
+                  POOFF,POTRANS,POWT,PIOFF,PITRANS,PIWT,NSECTIONS} Section;
+    char _magic[8];     // "PNIMAGE" and a 0
+    uint32_t _version;
+    uint32_t _nplaces;
+    uint32_t _ntransitions;
+    uint32_t _pad;
+    PNImageSection _sections[NSECTIONS];
+};
+
+class PNImageWriter
+{
+    PNImageHeader _hdr {};
+    vector<pair<const void*, uint64_t>> _data; // of each section, size in bytes
+public:
+    PNImageWriter(unsigned nplaces, unsigned ntransitions) : _data(PNImageHeader::NSECTIONS, {nullptr, 0})
+    {
+        memcpy(_hdr._magic, "PNIMAGE", 8);
+        _hdr._version = PNImageHeader::VERSION;
+        _hdr._nplaces = nplaces;
+        _hdr._ntransitions = ntransitions;
+    }
+    template<typename T> void section(PNImageHeader::Section s, const T *data, uint64_t count)
+    {
+        _hdr._sections[s]._count = count;
+        _data[s] = {data, count * sizeof(T)};
+    }
+    void write(string filename)
+    {
+        uint64_t off = sizeof(PNImageHeader);
+        for(unsigned s=0; s<PNImageHeader::NSECTIONS; s++)
+        {
+            _hdr._sections[s]._off = off;
+            off = ( off + _data[s].second + 7 ) / 8 * 8;
+        }
+        ofstream ofs(filename, ios::binary);
+        ofs.write((char*) &_hdr, sizeof(_hdr));
+        for(unsigned s=0; s<PNImageHeader::NSECTIONS; s++)
+        {
+            ofs.write((char*) _data[s].first, _data[s].second);
+            ofs.write("\0\0\0\0\0\0\0", ( 8 - _data[s].second % 8 ) % 8);
+        }
+        if ( not ofs )
+        {
+            cout << "PNImageWriter : can't write " << filename << endl;
+            exit(1);
+        }
+    }
+};
+
+// Read only mapping of an image, stays mapped as long as this lives
+class PNImage
+{
+    char *_base = NULL;
+    size_t _len = 0;
+    void bad(string filename, string why)
+    {
+        cout << "PNImage : " << filename << " " << why << endl;
+        exit(1);
+    }
+public:
+    const PNImageHeader& header() { return *(PNImageHeader*) _base; }
+    template<typename T> const T* section(PNImageHeader::Section s) { return (T*) ( _base + header()._sections[s]._off ); }
+    uint64_t count(PNImageHeader::Section s) { return header()._sections[s]._count; }
+    void open(string filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if ( fd < 0 or fstat(fd, &st) != 0 ) bad(filename, "can't be opened");
+        _len = st.st_size;
+        if ( _len >= sizeof(PNImageHeader) ) _base = (char*) mmap(NULL, _len, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if ( _base == NULL or _base == MAP_FAILED or memcmp(_base, "PNIMAGE", 8) != 0 )
+        {
+            _base = NULL;
+            bad(filename, "is not a petrisimu net image");
+        }
+        if ( header()._version != PNImageHeader::VERSION )
+            bad(filename, "is of version " + to_string(header()._version) + ", expected " + to_string(PNImageHeader::VERSION));
+        static const unsigned elemsize[PNImageHeader::NSECTIONS] = {sizeof(PNImageNode), 1, 12, 4,4,4,4,4,4, 4,4,4,4,4,4};
+        for(unsigned s=0; s<PNImageHeader::NSECTIONS; s++)
+        {
+            auto& sec = header()._sections[s];
+            if ( sec._off % 8 or sec._off > _len or sec._count > ( _len - sec._off ) / elemsize[s] )
+                bad(filename, "is truncated");
+        }
+    }
+    ~PNImage() { if ( _base ) munmap(_base, _len); }
+};
+
+#endif
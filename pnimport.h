@@ -0,0 +1,623 @@
+#ifndef _PNIMPORT_H
+#define _PNIMPORT_H
+
+// Importers of nets from PNML (place/transition nets) and from the json
+// written by printjson, building the net through the bulk construction path
+// (createPlaces, createTransitions and createArcs).
+//
+//     MTPetriNet pn;
+//     importPnml(pn, "petri.pnml");    // or importJson(pn, "petri.json")
+//     pn.init();
+//
+// Documents are parsed as a stream, in a single pass: what is kept is a
+// record per node and arc, so memory is bounded by the net, not by the
+// document (graphics, tool specific data etc. are skipped as they go by).
+//
+// PNML: places with name and initialMarking, transitions with name and arcs
+// with inscription (the weight) are read from all nets and pages, anything
+// else is ignored. Node ids may be any strings, a node without a name is
+// named by its id. PNML places have no capacity, they are created with
+// capacity 0 (unlimited). json: places with label,
+// marking and capacity, transitions with label and arcs with src, tgt and wt.
+//
+// Nodes are created in document order, or if all node ids are numbers (as in
+// files written by printpnml and printjson), in the order of their ids, so
+// that a net exported and imported into an empty net keeps its node ids.
+// Quit places, actions, arc choosers and delays aren't part of either format
+// and have to be set up after importing. A malformed document or an arc to
+// an unknown node id exits, arcs between two places or two transitions exit
+// when the net is frozen.
+
+#include <string>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include "petrinet.h"
+
+// Buffered character source, counts lines for error messages
+class PNImportReader
+{
+    istream& _is;
+    string _what; // file name, for errors
+    vector<char> _buf = vector<char>(1 << 16);
+    size_t _pos = 0, _len = 0;
+    unsigned _line = 1;
+    bool fill()
+    {
+        _is.read(_buf.data(), _buf.size());
+        _len = _is.gcount();
+        _pos = 0;
+        return _len > 0;
+    }
+public:
+    static constexpr int END = -1;
+    int peek() { return _pos < _len or fill() ? (unsigned char) _buf[_pos] : END; }
+    int get()
+    {
+        int c = peek();
+        if ( c != END ) _pos++;
+        if ( c == '\n' ) _line++;
+        return c;
+    }
+    // Consumes s if it is next. Only for literals within the
+    // lookahead, i.e. shorter than the buffer.
+    bool skipif(const char *s)
+    {
+        size_t n = strlen(s);
+        if ( _len - _pos < n )
+        {
+            // move the tail to the front and top up
+            size_t left = _len - _pos;
+            memmove(_buf.data(), _buf.data() + _pos, left);
+            _is.read(_buf.data() + left, _buf.size() - left);
+            _len = left + _is.gcount();
+            _pos = 0;
+            if ( _len < n ) return false;
+        }
+        if ( memcmp(_buf.data() + _pos, s, n) != 0 ) return false;
+        for(size_t i=0; i<n; i++) get();
+        return true;
+    }
+    // Consumes up to and including s
+    void skipto(const char *s)
+    {
+        while ( not skipif(s) )
+            if ( get() == END ) error(string("no closing ") + s);
+    }
+    void skipws() { while ( isspace(peek()) ) get(); }
+    static void utf8(string& s, unsigned long cp)
+    {
+        if ( cp < 0x80 ) s += (char) cp;
+        else if ( cp < 0x800 ) s += { (char) ( 0xc0 | cp >> 6 ), (char) ( 0x80 | ( cp & 0x3f ) ) };
+        else if ( cp < 0x10000 )
+            s += { (char) ( 0xe0 | cp >> 12 ), (char) ( 0x80 | ( cp >> 6 & 0x3f ) ), (char) ( 0x80 | ( cp & 0x3f ) ) };
+        else
+            s += { (char) ( 0xf0 | cp >> 18 ), (char) ( 0x80 | ( cp >> 12 & 0x3f ) ),
+                   (char) ( 0x80 | ( cp >> 6 & 0x3f ) ), (char) ( 0x80 | ( cp & 0x3f ) ) };
+    }
+    void error(string msg)
+    {
+        cout << "PNImport : " << _what << ":" << _line << " " << msg << endl;
+        exit(1);
+    }
+    PNImportReader(istream& is, string what) : _is(is), _what(what) {}
+};
+
+// Nodes and arcs as read, till the whole document is seen. Node ids are
+// mapped to slots as they are met (arcs may come before their nodes).
+// Numeric ids, as written by printpnml and printjson, are looked up in an
+// array while they are dense enough, other ids in a hash map.
+class PNImportNet
+{
+    static constexpr unsigned NONE = UINT_MAX;
+    unordered_map<string, unsigned> _slots;
+    vector<unsigned> _numslots; // by numeric id
+    class Id
+    {
+    public:
+        const string *_str; // key in _slots, null for a numeric id
+        unsigned _num;
+    };
+    vector<Id> _ids; // by slot
+    unsigned newslot(const string *str, unsigned num)
+    {
+        _ids.push_back({str, num});
+        return _ids.size() - 1;
+    }
+    unsigned mapslot(const string& id)
+    {
+        auto it = _slots.emplace(id, _ids.size());
+        if ( it.second ) newslot(&it.first->first, NONE);
+        return it.first->second;
+    }
+public:
+    class Node
+    {
+    public:
+        bool _place;
+        unsigned _slot;
+        string _name;
+        unsigned _marking = 0;
+        unsigned _capacity = 1;
+    };
+    vector<Node> _nodes;
+    vector<PNArcSpec> _arcs; // _src and _dst are slots
+
+    // Numeric id n, str its text if at hand. An id once in the array is
+    // looked up there only, one in the map (met while out of the array's
+    // reach) is moved to the array when it gets within reach.
+    unsigned slot(unsigned n, const string *str = nullptr)
+    {
+        if ( n < _numslots.size() and _numslots[n] != NONE ) return _numslots[n];
+        if ( n >= _numslots.size() and n < 4 * _ids.size() + 65536 )
+            _numslots.resize(max(n + 1, (unsigned) _numslots.size() * 2), NONE);
+        string id = str ? *str : to_string(n);
+        if ( n < _numslots.size() )
+        {
+            auto it = _slots.empty() ? _slots.end() : _slots.find(id);
+            return _numslots[n] = it != _slots.end() ? it->second : newslot(nullptr, n);
+        }
+        unsigned s = mapslot(id);
+        _ids[s]._num = n;
+        return s;
+    }
+    unsigned slot(const string& id)
+    {
+        // canonical decimal numbers only, "007" isn't "7"
+        if ( not id.empty() and id.size() < 10 and ( id[0] != '0' or id.size() == 1 )
+             and all_of(id.begin(), id.end(), [](char c){ return isdigit(c); }) )
+            return slot(stoul(id), &id);
+        return mapslot(id);
+    }
+    string idstr(unsigned slot) { return _ids[slot]._str ? *_ids[slot]._str : to_string(_ids[slot]._num); }
+    Node& addNode(PNImportReader& rd, bool place, const string& id)
+    {
+        if ( id.empty() ) rd.error("node without an id");
+        _nodes.push_back({place, slot(id)});
+        return _nodes.back();
+    }
+    void build(PetriNetBase& pn, PNImportReader& rd)
+    {
+        if ( all_of(_nodes.begin(), _nodes.end(), [&](Node& n){ return _ids[n._slot]._num != NONE; }) )
+            stable_sort(_nodes.begin(), _nodes.end(), [&](const Node& l, const Node& r)
+                { return _ids[l._slot]._num < _ids[r._slot]._num; });
+        vector<unsigned> nodeid(_ids.size(), NONE);
+        vector<string> names;
+        vector<unsigned> markings, capacities;
+        // runs of places or of transitions, each one bulk created
+        for(size_t i=0, j; i<_nodes.size(); i=j)
+        {
+            names.clear();
+            markings.clear();
+            capacities.clear();
+            for(j=i; j<_nodes.size() and _nodes[j]._place == _nodes[i]._place; j++)
+            {
+                if ( nodeid[_nodes[j]._slot] != NONE ) rd.error("duplicate node id " + idstr(_nodes[j]._slot));
+                nodeid[_nodes[j]._slot] = 0;
+                names.push_back(move(_nodes[j]._name));
+                markings.push_back(_nodes[j]._marking);
+                capacities.push_back(_nodes[j]._capacity);
+            }
+            unsigned first = _nodes[i]._place ? pn.createPlaces(names, markings, capacities) : pn.createTransitions(names);
+            for(size_t k=i; k<j; k++) nodeid[_nodes[k]._slot] = first + ( k - i );
+        }
+        for(auto& a:_arcs)
+        {
+            for(auto s:{a._src, a._dst})
+                if ( nodeid[s] == NONE ) rd.error("arc to unknown node id " + idstr(s));
+            a = {nodeid[a._src], nodeid[a._dst], a._wt};
+        }
+        pn.createArcs(_arcs);
+    }
+};
+
+// SAX style XML parser: calls H::start(name, attrs) and H::end(name) for each
+// element, with namespace prefixes dropped, and H::text(chars) for character
+// data (entities decoded, CDATA included). Declarations, processing
+// instructions and comments are skipped. Not validating, and the DOCTYPE
+// internal subset isn't interpreted, i.e. only predefined and character
+// entities are known.
+template<typename H> class PNXmlParser
+{
+    PNImportReader& _rd;
+    H& _h;
+    string _name, _text;
+    vector<pair<string,string>> _attrs;
+    vector<string> _open; // element stack, to check nesting
+
+    static bool namechar(int c) { return isalnum(c) or c == '_' or c == '-' or c == '.' or c == ':' or c >= 0x80; }
+    void readName(string& name)
+    {
+        name.clear();
+        while ( namechar(_rd.peek()) ) name += (char) _rd.get();
+        if ( name.empty() ) _rd.error("bad markup");
+        auto colon = name.rfind(':');
+        if ( colon != string::npos ) name.erase(0, colon + 1);
+    }
+    // After the '&'
+    void readEntity(string& s)
+    {
+        string ent;
+        for(int c; ( c = _rd.get() ) != ';'; ent += (char) c)
+            if ( c == PNImportReader::END or ent.size() > 16 ) _rd.error("bad entity");
+        if ( ent == "lt" ) s += '<';
+        else if ( ent == "gt" ) s += '>';
+        else if ( ent == "amp" ) s += '&';
+        else if ( ent == "quot" ) s += '"';
+        else if ( ent == "apos" ) s += '\'';
+        else if ( ent.size() > 1 and ent[0] == '#' )
+        {
+            bool hex = ent[1] == 'x';
+            char *end;
+            unsigned long cp = strtoul(ent.c_str() + 1 + hex, &end, hex ? 16 : 10);
+            if ( *end or cp > 0x10ffff ) _rd.error("bad character reference &" + ent + ";");
+            PNImportReader::utf8(s, cp);
+        }
+        else _rd.error("unknown entity &" + ent + ";");
+    }
+    void readAttrs()
+    {
+        _attrs.clear();
+        for(;;)
+        {
+            _rd.skipws();
+            int c = _rd.peek();
+            if ( c == '>' or c == '/' or c == PNImportReader::END ) return;
+            string name, val;
+            readName(name);
+            _rd.skipws();
+            if ( _rd.get() != '=' ) _rd.error("attribute " + name + " without value");
+            _rd.skipws();
+            int q = _rd.get();
+            if ( q != '"' and q != '\'' ) _rd.error("attribute " + name + " value not quoted");
+            for(int c; ( c = _rd.get() ) != q; )
+            {
+                if ( c == PNImportReader::END or c == '<' ) _rd.error("bad value of attribute " + name);
+                if ( c == '&' ) readEntity(val);
+                else val += (char) c;
+            }
+            _attrs.emplace_back(move(name), move(val));
+        }
+    }
+    void flushText()
+    {
+        if ( _text.empty() ) return;
+        if ( _open.empty() )
+        {
+            if ( not all_of(_text.begin(), _text.end(), [](char c){ return isspace((unsigned char) c); }) )
+                _rd.error("text outside the document element");
+        }
+        else _h.text(_text);
+        _text.clear();
+    }
+public:
+    void parse()
+    {
+        bool seenroot = false;
+        for(int c; ( c = _rd.peek() ) != PNImportReader::END; )
+        {
+            if ( c != '<' )
+            {
+                _rd.get();
+                if ( c == '&' ) readEntity(_text);
+                else _text += (char) c;
+                continue;
+            }
+            _rd.get();
+            if ( _rd.skipif("![CDATA[") )
+            {
+                while ( not _rd.skipif("]]>") )
+                {
+                    int d = _rd.get();
+                    if ( d == PNImportReader::END ) _rd.error("no closing ]]>");
+                    _text += (char) d;
+                }
+                continue;
+            }
+            flushText();
+            c = _rd.peek();
+            if ( c == '?' ) _rd.skipto("?>");
+            else if ( _rd.skipif("!--") ) _rd.skipto("-->");
+            else if ( c == '!' )
+            {
+                // DOCTYPE, possibly with an internal subset in []
+                for(int depth=0, d; ( d = _rd.get() ) != '>' or depth; )
+                {
+                    if ( d == PNImportReader::END ) _rd.error("no closing >");
+                    depth += ( d == '[' ) - ( d == ']' );
+                }
+            }
+            else if ( c == '/' )
+            {
+                _rd.get();
+                readName(_name);
+                _rd.skipws();
+                if ( _rd.get() != '>' ) _rd.error("bad end tag " + _name);
+                if ( _open.empty() or _open.back() != _name ) _rd.error("unexpected end tag " + _name);
+                _open.pop_back();
+                _h.end(_name);
+            }
+            else
+            {
+                if ( seenroot and _open.empty() ) _rd.error("more than one document element");
+                seenroot = true;
+                readName(_name);
+                readAttrs();
+                bool empty = _rd.peek() == '/' and _rd.get();
+                if ( _rd.get() != '>' ) _rd.error("bad start tag " + _name);
+                _open.push_back(_name);
+                _h.start(_open.back(), _attrs);
+                if ( empty )
+                {
+                    _open.pop_back();
+                    _h.end(_name);
+                }
+            }
+        }
+        flushText();
+        if ( not _open.empty() ) _rd.error("unexpected end of document in " + _open.back());
+        if ( not seenroot ) _rd.error("no document element");
+    }
+    PNXmlParser(PNImportReader& rd, H& h) : _rd(rd), _h(h) {}
+};
+
+// Picks the net out of the PNML elements
+class PNPnmlHandler
+{
+    PNImportReader& _rd;
+    PNImportNet& _net;
+    vector<string> _path; // open elements
+    string _text; // of the innermost open element
+    PNImportNet::Node *_node = nullptr; // the place or transition open
+    bool _inarc = false;
+
+    static string attr(const vector<pair<string,string>>& attrs, const char *name)
+    {
+        for(auto& a:attrs) if ( a.first == name ) return a.second;
+        return "";
+    }
+    unsigned number(const string& s, const char *what)
+    {
+        size_t b = s.find_first_not_of(" \t\r\n"), e = s.find_last_not_of(" \t\r\n");
+        if ( b == string::npos ) _rd.error(string("empty ") + what);
+        string n = s.substr(b, e - b + 1);
+        if ( not all_of(n.begin(), n.end(), [](char c){ return isdigit(c); }) or n.size() > 9 )
+            _rd.error(string("bad ") + what + " " + n);
+        return stoul(n);
+    }
+    // Name of the ancestor i levels up from the innermost open element
+    const string& up(unsigned i)
+    {
+        static const string none;
+        return _path.size() > i ? _path[_path.size() - 1 - i] : none;
+    }
+public:
+    void start(const string& name, const vector<pair<string,string>>& attrs)
+    {
+        _path.push_back(name);
+        _text.clear();
+        // nodes and arcs are children of a net or a page
+        if ( up(1) != "net" and up(1) != "page" ) return;
+        if ( name == "place" or name == "transition" )
+        {
+            auto id = attr(attrs, "id");
+            _node = &_net.addNode(_rd, name == "place", id);
+            _node->_name = id; // unless named
+            _node->_capacity = 0;
+        }
+        else if ( name == "arc" )
+        {
+            auto src = attr(attrs, "source"), dst = attr(attrs, "target");
+            if ( src.empty() or dst.empty() ) _rd.error("arc without source or target");
+            _net._arcs.push_back({_net.slot(src), _net.slot(dst), 1});
+            _inarc = true;
+        }
+    }
+    void end(const string& name)
+    {
+        // <place><name><text>..</text></name>, likewise initialMarking and
+        // arc inscription, labels elsewhere (e.g. of the net) don't matter
+        if ( name == "text" and ( up(3) == "net" or up(3) == "page" ) )
+        {
+            if ( _node and up(1) == "name" ) _node->_name = _text;
+            else if ( _node and _node->_place and up(1) == "initialMarking" ) _node->_marking = number(_text, "initialMarking");
+            else if ( _inarc and up(1) == "inscription" ) _net._arcs.back()._wt = number(_text, "inscription");
+        }
+        if ( up(1) == "net" or up(1) == "page" )
+        {
+            _node = nullptr;
+            _inarc = false;
+        }
+        _path.pop_back();
+        _text.clear();
+    }
+    void text(const string& chars) { if ( up(0) == "text" ) _text += chars; }
+    PNPnmlHandler(PNImportReader& rd, PNImportNet& net) : _rd(rd), _net(net) {}
+};
+
+// Pull parser over the json of printjson
+class PNJsonImporter
+{
+    PNImportReader& _rd;
+    PNImportNet& _net;
+    string _key;
+
+    void expect(char c)
+    {
+        _rd.skipws();
+        if ( _rd.get() != c ) _rd.error(string("expected ") + c);
+    }
+    void readString(string& s)
+    {
+        s.clear();
+        expect('"');
+        for(int c; ( c = _rd.get() ) != '"'; )
+        {
+            if ( c == PNImportReader::END or c < 0x20 ) _rd.error("bad string");
+            if ( c != '\\' )
+            {
+                s += (char) c;
+                continue;
+            }
+            c = _rd.get();
+            if ( c == 'n' ) s += '\n';
+            else if ( c == 't' ) s += '\t';
+            else if ( c == 'r' ) s += '\r';
+            else if ( c == 'b' ) s += '\b';
+            else if ( c == 'f' ) s += '\f';
+            else if ( c == '"' or c == '\\' or c == '/' ) s += (char) c;
+            else if ( c == 'u' )
+            {
+                unsigned long cp = hex4();
+                if ( cp >= 0xd800 and cp < 0xdc00 and _rd.skipif("\\u") )
+                    cp = 0x10000 + ( ( cp - 0xd800 ) << 10 ) + ( hex4() - 0xdc00 );
+                PNImportReader::utf8(s, cp);
+            }
+            else _rd.error("bad escape in string");
+        }
+    }
+    unsigned long hex4()
+    {
+        unsigned long v = 0;
+        for(int i=0; i<4; i++)
+        {
+            int c = _rd.get();
+            if ( not isxdigit(c) ) _rd.error("bad \\u escape");
+            v = v * 16 + ( isdigit(c) ? c - '0' : tolower(c) - 'a' + 10 );
+        }
+        return v;
+    }
+    unsigned readUnsigned(const char *what)
+    {
+        _rd.skipws();
+        unsigned long v = 0;
+        unsigned n = 0;
+        for(; isdigit(_rd.peek()) and n < 10; n++) v = v * 10 + ( _rd.get() - '0' );
+        if ( n == 0 or v > UINT_MAX or isdigit(_rd.peek()) or _rd.peek() == '.' or _rd.peek() == 'e' or _rd.peek() == 'E' )
+            _rd.error(string("bad ") + what);
+        return v;
+    }
+    // Any value, for the keys not known
+    void skipValue()
+    {
+        _rd.skipws();
+        int c = _rd.peek();
+        if ( c == '"' ) readString(_key);
+        else if ( c == '{' ) members([&](){ skipValue(); });
+        else if ( c == '[' ) elements([&](){ skipValue(); });
+        else
+        {
+            // number, true, false or null
+            unsigned n = 0;
+            while ( isalnum(_rd.peek()) or _rd.peek() == '-' or _rd.peek() == '+' or _rd.peek() == '.' ) { _rd.get(); n++; }
+            if ( n == 0 ) _rd.error("bad value");
+        }
+    }
+    // Calls f for each member of an object, with the key in _key
+    template<typename F> void members(F f)
+    {
+        expect('{');
+        _rd.skipws();
+        if ( _rd.skipif("}") ) return;
+        do
+        {
+            readString(_key);
+            expect(':');
+            f();
+            _rd.skipws();
+        } while ( _rd.skipif(",") );
+        expect('}');
+    }
+    template<typename F> void elements(F f)
+    {
+        expect('[');
+        _rd.skipws();
+        if ( _rd.skipif("]") ) return;
+        do
+        {
+            f();
+            _rd.skipws();
+        } while ( _rd.skipif(",") );
+        expect(']');
+    }
+    void nodes(bool place)
+    {
+        members([&]()
+        {
+            auto& n = _net.addNode(_rd, place, _key);
+            members([&]()
+            {
+                if ( _key == "label" ) readString(n._name);
+                else if ( place and _key == "marking" ) n._marking = readUnsigned("marking");
+                else if ( place and _key == "capacity" ) n._capacity = readUnsigned("capacity");
+                else skipValue();
+            });
+        });
+    }
+public:
+    void parse()
+    {
+        members([&]()
+        {
+            if ( _key == "places" ) nodes(true);
+            else if ( _key == "transitions" ) nodes(false);
+            else if ( _key == "arcs" )
+                elements([&]()
+                {
+                    PNArcSpec a {UINT_MAX, UINT_MAX, 1};
+                    members([&]()
+                    {
+                        if ( _key == "src" ) a._src = _net.slot(readUnsigned("src"));
+                        else if ( _key == "tgt" ) a._dst = _net.slot(readUnsigned("tgt"));
+                        else if ( _key == "wt" ) a._wt = readUnsigned("wt");
+                        else skipValue();
+                    });
+                    if ( a._src == UINT_MAX or a._dst == UINT_MAX ) _rd.error("arc without src or tgt");
+                    _net._arcs.push_back(a);
+                });
+            else skipValue();
+        });
+        _rd.skipws();
+        if ( _rd.peek() != PNImportReader::END ) _rd.error("trailing data");
+    }
+    PNJsonImporter(PNImportReader& rd, PNImportNet& net) : _rd(rd), _net(net) {}
+};
+
+// Adds the net in the document to pn, which must not be frozen. what names
+// the document in error messages.
+inline void importPnml(PetriNetBase& pn, istream& is, string what = "pnml")
+{
+    PNImportReader rd(is, what);
+    PNImportNet net;
+    PNPnmlHandler h(rd, net);
+    PNXmlParser<PNPnmlHandler>(rd, h).parse();
+    net.build(pn, rd);
+}
+
+inline void importJson(PetriNetBase& pn, istream& is, string what = "json")
+{
+    PNImportReader rd(is, what);
+    PNImportNet net;
+    PNJsonImporter(rd, net).parse();
+    net.build(pn, rd);
+}
+
+inline void importFile(PetriNetBase& pn, string filename, void (*import)(PetriNetBase&, istream&, string))
+{
+    ifstream ifs(filename);
+    if ( not ifs )
+    {
+        cout << "PNImport : " << filename << " can't be opened" << endl;
+        exit(1);
+    }
+    import(pn, ifs, filename);
+}
+
+inline void importPnml(PetriNetBase& pn, string filename) { importFile(pn, filename, importPnml); }
+inline void importJson(PetriNetBase& pn, string filename) { importFile(pn, filename, importJson); }
+
+#endif
@@ -0,0 +1,209 @@
+#ifndef _PNLOG_H
+#define _PNLOG_H
+
+// Binary event log used by PNDBG.
+//
+// Each thread appends fixed size records to its own single producer single
+// consumer ring (see PNThreadRings), a background thread drains the rings to
+// the log file. So logging takes no lock and does no formatting or I/O on the
+// firing path. A full ring makes its thread wait for the drain, no record is
+// dropped.
+//
+// File layout (native endianness): magic "PNLOG002", the node table (count,
+// number of places, then nodeid, name length and name of each place and then
+// each transition), padding to 8 bytes and then PNLogRecords. Records of different threads are
+// interleaved in chunks, each thread's records are in time order.
+// PNLogReader merges them by timestamp, see tools/pnlogdecode, which prints
+// the text format (p:, t: and wait: lines) of the earlier text log.
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "pnqueues.h"
+
+using namespace std;
+
+struct PNLogRecord
+{
+    typedef enum {ADD,DEDUCT,WAIT,FIRE} Typ;
+    uint64_t _ts;       // ns since the log was opened
+    uint64_t _seqno;    // eseqno of a firing
+    uint32_t _nodeid;
+    uint32_t _delta;    // tokens added or deducted
+    uint32_t _tokens;   // token count of the place after the change
+    uint32_t _typ;
+};
+
+class PNLogger
+{
+    inline static mutex _livemutex;
+    inline static set<PNLogger*> _live;
+    inline static bool _atexitset = false;
+
+    ofstream _ofs;
+    mutex _ofsmutex;
+    chrono::steady_clock::time_point _t0 = chrono::steady_clock::now();
+    PNThreadRings<PNLogRecord> _rings;
+
+    static void flushall()
+    {
+        const lock_guard<mutex> lock(_livemutex);
+        for(auto l:_live) l->flush();
+    }
+public:
+    void log(PNLogRecord::Typ typ, unsigned nodeid, unsigned delta, unsigned tokens, unsigned long seqno)
+    {
+        auto r = _rings.claim();
+        auto& rec = r->next();
+        rec._ts = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - _t0).count();
+        rec._seqno = seqno;
+        rec._nodeid = nodeid;
+        rec._delta = delta;
+        rec._tokens = tokens;
+        rec._typ = typ;
+        _rings.publish(r);
+    }
+    // Writes all records logged so far to the file
+    void flush()
+    {
+        _rings.flush();
+        const lock_guard<mutex> lock(_ofsmutex);
+        _ofs.flush();
+    }
+    void open(string logfile)
+    {
+        _ofs.open(logfile, ios::binary);
+    }
+    // Writes the node table (the first nplaces nodes are places) and starts
+    // draining, to be called (once) before any record is logged
+    void start(vector<pair<unsigned,string>> nodes, unsigned nplaces)
+    {
+        _ofs.write("PNLOG002", 8);
+        uint32_t n = nodes.size(), np = nplaces;
+        _ofs.write((char*) &n, sizeof(n));
+        _ofs.write((char*) &np, sizeof(np));
+        for(auto& node:nodes)
+        {
+            uint32_t id = node.first, len = node.second.size();
+            _ofs.write((char*) &id, sizeof(id));
+            _ofs.write((char*) &len, sizeof(len));
+            _ofs.write(node.second.data(), len);
+        }
+        // Records start 8 byte aligned
+        _ofs.write("\0\0\0\0\0\0\0", (8 - _ofs.tellp() % 8) % 8);
+        _rings.start([this](PNLogRecord* recs, unsigned n)
+        {
+            const lock_guard<mutex> lock(_ofsmutex);
+            _ofs.write((char*) recs, n * sizeof(PNLogRecord));
+        });
+    }
+    PNLogger()
+    {
+        const lock_guard<mutex> lock(_livemutex);
+        // Loggers not destroyed before exit (or exit from an error path) still
+        // get their records written
+        if ( not _atexitset ) _atexitset = atexit(flushall) == 0;
+        _live.insert(this);
+    }
+    ~PNLogger()
+    {
+        {
+            const lock_guard<mutex> lock(_livemutex);
+            _live.erase(this);
+        }
+        _rings.stop();
+        flush();
+    }
+};
+
+// Read only view of a log file, mapped to memory, so that logs larger than
+// the memory can be processed
+class PNLogReader
+{
+    char *_base = NULL;
+    size_t _len = 0;
+    PNLogRecord *_recs = NULL;
+    unsigned long _nrecs = 0;
+public:
+    // (nodeid, name) of places followed by transitions
+    vector<pair<unsigned,string>> _nodes;
+    unsigned _nplaces = 0;
+    bool empty() { return _len == 0; }
+    unsigned long size() { return _nrecs; }
+    // Calls f on each record in timestamp order. The file consists of runs of
+    // records in time order (one per drain of a thread's ring), which are
+    // merged here, memory taken is proportional to the number of runs.
+    template<typename F> void forEachInOrder(F f)
+    {
+        typedef pair<uint64_t,pair<unsigned long,unsigned long>> Cursor; // ts, (pos, run end)
+        auto later = [](Cursor& l, Cursor& r) { return l.first > r.first or ( l.first == r.first and l.second.first > r.second.first ); };
+        priority_queue<Cursor, vector<Cursor>, decltype(later)> runs(later);
+        for(unsigned long i=0, start=0; i<_nrecs; i++)
+            if ( i+1 == _nrecs or _recs[i+1]._ts < _recs[i]._ts )
+            {
+                runs.push({_recs[start]._ts, {start, i+1}});
+                start = i+1;
+            }
+        while ( not runs.empty() )
+        {
+            auto c = runs.top();
+            runs.pop();
+            f(_recs[c.second.first]);
+            if ( ++c.second.first < c.second.second )
+                runs.push({_recs[c.second.first]._ts, c.second});
+        }
+    }
+    PNLogReader(string logfile)
+    {
+        int fd = ::open(logfile.c_str(), O_RDONLY);
+        struct stat st;
+        if ( fd < 0 or fstat(fd, &st) != 0 )
+        {
+            cout << "PNLogReader : can't open " << logfile << endl;
+            exit(1);
+        }
+        _len = st.st_size;
+        if ( _len ) _base = (char*) mmap(NULL, _len, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if ( _len == 0 ) return; // the net never ran
+        if ( _base == MAP_FAILED or _len < 16 or memcmp(_base, "PNLOG002", 8) != 0 )
+        {
+            cout << "PNLogReader : " << logfile << " is not a petrisimu binary log" << endl;
+            exit(1);
+        }
+        char *p = _base + 8;
+        uint32_t n;
+        memcpy(&n, p, 4);
+        memcpy(&_nplaces, p+4, 4);
+        p += 8;
+        for(uint32_t i=0; i<n; i++)
+        {
+            uint32_t id, len;
+            memcpy(&id, p, 4);
+            memcpy(&len, p+4, 4);
+            _nodes.push_back({id, string(p+8, len)});
+            p += 8 + len;
+        }
+        p = _base + (p - _base + 7) / 8 * 8;
+        _recs = (PNLogRecord*) p;
+        _nrecs = (_base + _len - p) / sizeof(PNLogRecord);
+    }
+    ~PNLogReader() { if ( _len ) munmap(_base, _len); }
+};
+
+#endif
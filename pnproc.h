@@ -0,0 +1,780 @@
+#ifndef _PNPROC_H
+#define _PNPROC_H
+
+// Simulation of one net by several processes on the same host (NPROCS).
+//
+// The transitions are partitioned over the processes as for
+// MTPetriNet::setAffinity (see PNCompiledNet::partition), each place is
+// owned by the process holding most of its consumers. A process keeps the
+// tokens of the places it owns and fires its transitions from a single loop,
+// like an STPetriNet, and holds state only for its transitions and for the
+// places they touch. Processes talk only by messages, through single
+// producer single consumer rings in memory shared by them, one per ordered
+// pair of processes sharing places:
+//
+//      DEPOSIT(p,n)        a firing put n tokens in p, owned by the receiver
+//      COUNT(p,n)          p, owned by the sender, now holds n tokens. Sent
+//                          to the processes having consumers of p, which
+//                          mirror the count of such boundary places to see
+//                          whether their transitions may be enabled.
+//      RESERVE(t,p,w)      transition t of the sender wants w tokens of p
+//      GRANT(t,p,w)        they were taken out of p for t
+//      DENY(t,p,w)         p doesn't hold them
+//
+// A transition whose input places are all local fires right away. Else its
+// local inputs are taken and the remote ones reserved, it fires once all the
+// reservations are granted. On a denial the tokens taken are returned and
+// the transition is retried after a random backoff, which breaks up
+// processes repeatedly denying each other.
+//
+// The run ends when a quit place gets a token, when about maxfirings
+// transitions have fired, or when the net is dead: the parent process sees
+// every partition idle twice over with the same counts of messages, and as
+// many messages received as sent (Mattern's four counter method).
+//
+// The state a process builds (its rows over local ids, token counts and
+// queues) is in proportion to its partition, but it's built from the
+// structure of the whole net. Run from a PetriNetBase, that's the net built
+// by the parent, which the processes inherit copy on write: the whole net
+// must fit in the parent process. Run from a net image, no net is built: the
+// compiled arrays are viewed in the mapped file, whose pages are shared by
+// the processes (and may be evicted), and the parent only holds a few
+// integers per node (parts of transitions, owners and initial marking of
+// places, the final marking in shared memory).
+//
+// Partitions simulate the bare net (actions, arc choosers, delays and the
+// event listener aren't invoked). With PNDBG each
+// partition writes its own log <netname>.<partition>.petri.bin.
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include "petrinet.h"
+#include "pnrandom.h"
+
+class PNProcMsg
+{
+public:
+    typedef enum {DEPOSIT,COUNT,RESERVE,GRANT,DENY,NOPS} Op;
+    uint32_t _op, _a, _b, _c;
+};
+
+// Lives in shared memory, hence fixed size and no pointers
+class PNProcRing
+{
+    static constexpr unsigned SIZE = 1 << 14; // a power of 2
+    alignas(64) atomic<unsigned long> _head {0}; // written by producer
+    alignas(64) atomic<unsigned long> _tail {0}; // written by consumer
+    PNProcMsg _buf[SIZE];
+public:
+    // Producer only, false if full
+    bool push(const PNProcMsg& msg)
+    {
+        unsigned long head = _head.load(memory_order_relaxed);
+        if ( head - _tail.load(memory_order_acquire) == SIZE ) return false;
+        _buf[head & (SIZE-1)] = msg;
+        _head.store(head + 1, memory_order_release);
+        return true;
+    }
+    // Consumer only, calls f on each pending message, returns how many
+    template<typename F> unsigned drain(F f)
+    {
+        unsigned long tail = _tail.load(memory_order_relaxed);
+        unsigned long head = _head.load(memory_order_acquire);
+        for(unsigned long i=tail; i<head; i++) f(_buf[i & (SIZE-1)]);
+        _tail.store(head, memory_order_release);
+        return head - tail;
+    }
+    bool empty() { return _head.load(memory_order_acquire) == _tail.load(memory_order_relaxed); }
+};
+
+// Counters of a partition, written by its process
+class PNProcStats
+{
+public:
+    unsigned _ntransitions = 0, _nplaces = 0; // owned
+    unsigned long _firings = 0;
+    unsigned long _failed = 0; // firings given up on a denied reservation
+    unsigned long _sent[PNProcMsg::NOPS] = {};
+    unsigned long _received = 0;
+    unsigned long sent()
+    {
+        unsigned long n = 0;
+        for(auto s:_sent) n += s;
+        return n;
+    }
+};
+
+class PNProcResult
+{
+public:
+    typedef enum {DEAD,QUIT,LIMIT} Status;
+    Status _status = DEAD;
+    unsigned long _firings = 0;
+    double _secs = 0;
+    // Of each place, exact for a dead net. Tokens in transit when a quit
+    // place or the limit stopped the run are missing.
+    vector<unsigned> _marking;
+    vector<PNProcStats> _parts;
+    string statusstr()
+    {
+        switch(_status)
+        {
+            case DEAD : return "DEAD";
+            case QUIT : return "QUIT";
+            default   : return "LIMIT";
+        }
+    }
+    // A line per partition with its firing and message rates, and a total
+    void print(ostream& os)
+    {
+        unsigned long msgs = 0;
+        for(unsigned k=0; k<_parts.size(); k++)
+        {
+            auto& s = _parts[k];
+            msgs += s.sent();
+            os << "PN_PROC:" << k << ":transitions=" << s._ntransitions << ":places=" << s._nplaces
+               << ":firings=" << s._firings << ":firings_per_sec=" << (unsigned long) ( s._firings / _secs )
+               << ":msgs_sent=" << s.sent() << ":msgs_received=" << s._received
+               << ":msgs_per_sec=" << (unsigned long) ( s.sent() / _secs )
+               << ":deposits=" << s._sent[PNProcMsg::DEPOSIT] << ":counts=" << s._sent[PNProcMsg::COUNT]
+               << ":reserves=" << s._sent[PNProcMsg::RESERVE] << ":denied=" << s._sent[PNProcMsg::DENY]
+               << ":failed=" << s._failed << endl;
+        }
+        os << "PN_PROC:total:" << statusstr() << ":firings=" << _firings << ":secs=" << _secs
+           << ":firings_per_sec=" << (unsigned long) ( _firings / _secs )
+           << ":msgs_per_sec=" << (unsigned long) ( msgs / _secs ) << endl;
+    }
+};
+
+// Single use: construct, then call run once
+class PNProcSim
+{
+    // Control block in shared memory
+    class Ctl
+    {
+    public:
+        atomic<unsigned> _stop {0}; // 1 + Status once stopping
+        atomic<unsigned long> _firings {0};
+        void stop(PNProcResult::Status status)
+        {
+            unsigned none = 0;
+            _stop.compare_exchange_strong(none, 1 + status);
+        }
+    };
+    class alignas(64) PartCtl
+    {
+    public:
+        // Incremented on going idle and on leaving it, odd while idle
+        atomic<unsigned long> _state {0};
+        atomic<unsigned long> _sent {0}, _received {0}; // messages through the rings
+        PNProcStats _stats;
+    };
+
+    // The state and simulation loop of one partition, in its process. Its
+    // transitions, and the places it owns or its transitions take from, have
+    // local ids here, so that the state of a process is in proportion to its
+    // partition rather than to the net. Messages carry the ids of the net.
+    class Partition
+    {
+        static constexpr unsigned char IDLE = 0, READY = 1, PENDING = 2, DEFERRED = 3;
+        struct Grant
+        {
+            unsigned _from, _p, _tokens;
+        };
+        struct Pending
+        {
+            unsigned _waiting = 0;
+            bool _denied = false;
+            vector<Grant> _granted;
+        };
+        PNProcSim& _sim;
+        unsigned _self;
+        PartCtl& _ctl;
+        PNProcStats& _stats;
+        // Local places: id in the net, owner and whether it's a quit place
+        vector<unsigned> _pid, _powner;
+        vector<bool> _isquit;
+        vector<unsigned> _tid; // of local transitions in the net
+        unordered_map<unsigned,unsigned> _lplace, _ltrans; // local ids by net id
+        // Rows as in PNCompiledNet over local ids, except that an output
+        // place owned by another partition is given by its id in the net
+        vector<unsigned> _tioff, _tiplace, _tiwt;
+        vector<unsigned> _tooff, _toplace, _towt, _toowner;
+        vector<unsigned> _pooff, _potrans, _powt; // local consumers only
+        // Processes mirroring each owned place, [_woff[p],_woff[p+1]) in _wpart
+        vector<unsigned> _woff, _wpart;
+        vector<unsigned> _peers; // partitions sending to this one
+        // Of the places owned, else the last count received, if any
+        vector<unsigned> _tokens;
+        vector<unsigned char> _tstate;
+        deque<unsigned> _ready;
+        unordered_map<unsigned,Pending> _pending;
+        unordered_map<unsigned,unsigned> _failures; // consecutive, by transition
+        vector<pair<unsigned long,unsigned>> _deferred; // round due, transition
+        vector<unsigned> _dirty; // owned places whose count changed
+        vector<bool> _isdirty;
+        vector<deque<PNProcMsg>> _outbox; // when the ring is full
+        unsigned long _round = 0, _unreported = 0;
+        PNRandom _rng;
+#ifdef PNDBG
+        PNLogger _log;
+        vector<unsigned> _pnode, _tnode; // node ids of local places, transitions
+#endif
+
+        bool local(unsigned p) { return _powner[p] == _self; }
+        void send(unsigned to, PNProcMsg msg)
+        {
+            _stats._sent[msg._op]++;
+            if ( _outbox[to].empty() and _sim.ring(_self, to).push(msg) ) _ctl._sent++;
+            else _outbox[to].push_back(msg);
+        }
+        bool flushOutboxes()
+        {
+            bool pending = false;
+            for(unsigned to=0; to<_outbox.size(); to++)
+            {
+                auto& out = _outbox[to];
+                while ( not out.empty() and _sim.ring(_self, to).push(out.front()) )
+                {
+                    out.pop_front();
+                    _ctl._sent++;
+                }
+                pending = pending or not out.empty();
+            }
+            return pending;
+        }
+        void candidate(unsigned t)
+        {
+            if ( _tstate[t] != IDLE ) return;
+            _tstate[t] = READY;
+            _ready.push_back(t);
+        }
+        // Consumers of p whose arc threshold is crossed between lo and hi, as
+        // PNCompiledNet::forCrossedArcs
+        void wakeConsumers(unsigned p, unsigned lo, unsigned hi)
+        {
+            auto b = _powt.data() + _pooff[p], e = _powt.data() + _pooff[p+1];
+            for(auto w = upper_bound(b, e, lo); w != e and *w <= hi; w++) candidate(_potrans[w - _powt.data()]);
+        }
+        void markDirty(unsigned p)
+        {
+            if ( _woff[p] == _woff[p+1] or _isdirty[p] ) return;
+            _isdirty[p] = true;
+            _dirty.push_back(p);
+        }
+        void flushCounts()
+        {
+            for(auto p:_dirty)
+            {
+                for(unsigned i=_woff[p]; i<_woff[p+1]; i++)
+                    send(_wpart[i], {PNProcMsg::COUNT, _pid[p], _tokens[p], 0});
+                _isdirty[p] = false;
+            }
+            _dirty.clear();
+        }
+        void deposit(unsigned p, unsigned newtokens)
+        {
+            unsigned oldcnt = _tokens[p];
+            _tokens[p] += newtokens;
+#ifdef PNDBG
+            _log.log(PNLogRecord::ADD, _pnode[p], newtokens, _tokens[p], 0);
+#endif
+            if ( _isquit[p] ) _sim._ctl->stop(PNProcResult::QUIT);
+            wakeConsumers(p, oldcnt, _tokens[p]);
+            markDirty(p);
+        }
+        void deduct(unsigned p, unsigned tokens)
+        {
+            _tokens[p] -= tokens;
+#ifdef PNDBG
+            _log.log(PNLogRecord::DEDUCT, _pnode[p], tokens, _tokens[p], 0);
+#endif
+            markDirty(p);
+        }
+        void mirror(unsigned p, unsigned tokens)
+        {
+            unsigned oldcnt = _tokens[p];
+            _tokens[p] = tokens;
+            if ( tokens > oldcnt ) wakeConsumers(p, oldcnt, tokens);
+        }
+        void fire(unsigned t)
+        {
+#ifdef PNDBG
+            _log.log(PNLogRecord::FIRE, _tnode[t], 0, 0, _stats._firings);
+#endif
+            _stats._firings++;
+            if ( ++_unreported == 1024 ) reportFirings();
+            for(unsigned i=_tooff[t]; i<_tooff[t+1]; i++)
+            {
+                if ( _toowner[i] == _self ) deposit(_toplace[i], _towt[i]);
+                else send(_toowner[i], {PNProcMsg::DEPOSIT, _toplace[i], _towt[i], 0});
+            }
+            _tstate[t] = IDLE;
+            candidate(t);
+        }
+        void reportFirings()
+        {
+            if ( _sim._ctl->_firings.fetch_add(_unreported) + _unreported >= _sim._maxfirings )
+                _sim._ctl->stop(PNProcResult::LIMIT);
+            _unreported = 0;
+        }
+        void tryFire(unsigned t)
+        {
+            _tstate[t] = IDLE;
+            unsigned nremote = 0;
+            for(unsigned i=_tioff[t]; i<_tioff[t+1]; i++)
+            {
+                if ( _tokens[_tiplace[i]] < _tiwt[i] ) return;
+                nremote += not local(_tiplace[i]);
+            }
+            for(unsigned i=_tioff[t]; i<_tioff[t+1]; i++)
+            {
+                unsigned p = _tiplace[i];
+                if ( local(p) ) deduct(p, _tiwt[i]);
+                else send(_powner[p], {PNProcMsg::RESERVE, _tid[t], _pid[p], _tiwt[i]});
+            }
+            if ( nremote == 0 )
+            {
+                fire(t);
+                return;
+            }
+            _tstate[t] = PENDING;
+            _pending[t]._waiting = nremote;
+        }
+        void reserved(unsigned from, PNProcMsg& msg)
+        {
+            unsigned t = _ltrans.at(msg._a);
+            auto& pending = _pending[t];
+            if ( msg._op == PNProcMsg::GRANT ) pending._granted.push_back({from, msg._b, msg._c});
+            else pending._denied = true;
+            if ( --pending._waiting ) return;
+            if ( not pending._denied )
+            {
+                _pending.erase(t);
+                _failures.erase(t);
+                fire(t);
+                return;
+            }
+            for(auto& g:pending._granted) send(g._from, {PNProcMsg::DEPOSIT, g._p, g._tokens, 0});
+            _pending.erase(t);
+            for(unsigned i=_tioff[t]; i<_tioff[t+1]; i++)
+                if ( local(_tiplace[i]) ) deposit(_tiplace[i], _tiwt[i]);
+            _stats._failed++;
+            // Exponential backoff in rounds of the loop, randomized
+            unsigned failures = min(++_failures[t], 10U);
+            _tstate[t] = DEFERRED;
+            _deferred.push_back({_round + 1 + _rng.below(1U << failures), t});
+        }
+        void receive(unsigned from, PNProcMsg& msg)
+        {
+            switch(msg._op)
+            {
+                case PNProcMsg::DEPOSIT :
+                    deposit(_lplace.at(msg._a), msg._b);
+                    break;
+                case PNProcMsg::COUNT :
+                    mirror(_lplace.at(msg._a), msg._b);
+                    break;
+                case PNProcMsg::RESERVE :
+                {
+                    unsigned p = _lplace.at(msg._b);
+                    if ( _tokens[p] >= msg._c )
+                    {
+                        deduct(p, msg._c);
+                        send(from, {PNProcMsg::GRANT, msg._a, msg._b, msg._c});
+                    }
+                    else send(from, {PNProcMsg::DENY, msg._a, msg._b, msg._c});
+                    break;
+                }
+                default :
+                    reserved(from, msg);
+            }
+        }
+        unsigned receiveAll()
+        {
+            unsigned n = 0;
+            for(auto from:_peers)
+                n += _sim.ring(from, _self).drain([&](PNProcMsg& msg) { receive(from, msg); });
+            _ctl._received += n;
+            _stats._received += n;
+            return n;
+        }
+        bool incoming()
+        {
+            for(auto from:_peers)
+                if ( not _sim.ring(from, _self).empty() ) return true;
+            return false;
+        }
+        void retryDeferred()
+        {
+            for(unsigned i=0; i<_deferred.size(); )
+            {
+                if ( _deferred[i].first > _round )
+                {
+                    i++;
+                    continue;
+                }
+                unsigned t = _deferred[i].second;
+                _deferred[i] = _deferred.back();
+                _deferred.pop_back();
+                _tstate[t] = IDLE;
+                candidate(t);
+            }
+        }
+        // Waits for a message or the end of the run, idle as far as the
+        // termination detection goes
+        void idle()
+        {
+            reportFirings();
+            _ctl._state++;
+            for(unsigned spins=0; not incoming() and not _sim._ctl->_stop; spins++)
+            {
+                if ( spins < 64 ) this_thread::yield();
+                else this_thread::sleep_for(chrono::microseconds(50));
+            }
+            _ctl._state++;
+        }
+        void addPlace(unsigned p)
+        {
+            if ( not _lplace.emplace(p, _pid.size()).second ) return;
+            _pid.push_back(p);
+            _powner.push_back(_sim._owner[p]);
+            _isquit.push_back(_sim._cn._isquit[p]);
+            _tokens.push_back(_sim._m0[p]);
+        }
+    public:
+        void run()
+        {
+            for(unsigned t=0; t<_tid.size(); t++) candidate(t);
+            while ( not _sim._ctl->_stop.load(memory_order_relaxed) )
+            {
+                _round++;
+                unsigned nreceived = receiveAll();
+                for(unsigned i=0; i<256 and not _ready.empty(); i++)
+                {
+                    unsigned t = _ready.front();
+                    _ready.pop_front();
+                    tryFire(t);
+                }
+                retryDeferred();
+                flushCounts();
+                bool blocked = flushOutboxes();
+                if ( not _ready.empty() or nreceived ) continue;
+                if ( _pending.empty() and _deferred.empty() and not blocked ) idle();
+                else this_thread::yield();
+            }
+            for(unsigned p=0; p<_pid.size(); p++)
+                if ( local(p) ) _sim._marking[_pid[p]] = _tokens[p];
+        }
+        // Builds the local rows from the net's, which aren't used after that
+        Partition(PNProcSim& sim, unsigned self) : _sim(sim), _self(self), _ctl(sim._parts[self]),
+            _stats(sim._parts[self]._stats), _outbox(sim._nprocs), _rng(PNRandom::envSeed() + self)
+        {
+            auto& cn = _sim._cn;
+            for(unsigned t=0; t<cn.ntransitions(); t++)
+                if ( _sim._part[t] == _self )
+                {
+                    _ltrans[t] = _tid.size();
+                    _tid.push_back(t);
+                }
+            for(unsigned p=0; p<cn.nplaces(); p++)
+                if ( _sim._owner[p] == _self ) addPlace(p);
+            _tioff.push_back(0);
+            _tooff.push_back(0);
+            for(auto t:_tid)
+            {
+                for(unsigned i=cn._tioff[t]; i<cn._tioff[t+1]; i++)
+                {
+                    addPlace(cn._tiplace[i]);
+                    _tiplace.push_back(_lplace[cn._tiplace[i]]);
+                    _tiwt.push_back(cn._tiwt[i]);
+                }
+                _tioff.push_back(_tiplace.size());
+                for(unsigned i=cn._tooff[t]; i<cn._tooff[t+1]; i++)
+                {
+                    unsigned p = cn._toplace[i], owner = _sim._owner[p];
+                    _toplace.push_back(owner == _self ? _lplace[p] : p);
+                    _toowner.push_back(owner);
+                    _towt.push_back(cn._towt[i]);
+                }
+                _tooff.push_back(_toplace.size());
+            }
+            vector<bool> seen(_sim._nprocs, false);
+            _pooff.push_back(0);
+            _woff.push_back(0);
+            for(auto p:_pid)
+            {
+                for(unsigned i=cn._pooff[p]; i<cn._pooff[p+1]; i++)
+                {
+                    unsigned t = cn._potrans[i], k = _sim._part[t];
+                    if ( k == _self )
+                    {
+                        _potrans.push_back(_ltrans[t]);
+                        _powt.push_back(cn._powt[i]);
+                    }
+                    else if ( _sim._owner[p] == _self and not seen[k] )
+                    {
+                        seen[k] = true;
+                        _wpart.push_back(k);
+                    }
+                }
+                _pooff.push_back(_potrans.size());
+                for(unsigned i=_woff.back(); i<_wpart.size(); i++) seen[_wpart[i]] = false;
+                _woff.push_back(_wpart.size());
+            }
+            for(unsigned k=0; k<_sim._nprocs; k++)
+                if ( _sim._ringidx[k * _sim._nprocs + _self] != NORING ) _peers.push_back(k);
+            _tstate.assign(_tid.size(), IDLE);
+            _isdirty.assign(_pid.size(), false);
+#ifdef PNDBG
+            // Node table of the places owned and the local transitions
+            vector<pair<unsigned,string>> places, transitions;
+            _pnode.resize(_pid.size());
+            _tnode.resize(_tid.size());
+            _sim.forNodes([&](bool istrans, unsigned idx, unsigned nodeid, const string& name)
+            {
+                auto& ids = istrans ? _ltrans : _lplace;
+                auto l = ids.find(idx);
+                if ( l == ids.end() ) return;
+                ( istrans ? _tnode : _pnode )[l->second] = nodeid;
+                if ( istrans ) transitions.push_back({nodeid, name});
+                else if ( local(l->second) ) places.push_back({nodeid, name});
+            });
+            unsigned nplaces = places.size();
+            places.insert(places.end(), transitions.begin(), transitions.end());
+            _log.open(_sim._netname + "." + to_string(self) + ".petri.bin");
+            _log.start(places, nplaces);
+#endif
+        }
+    };
+
+    // Of a net image, if run from one
+    PNImage _image;
+    PNCompiledNet _imagecn;
+    PNCompiledNet& _cn;
+    string _netname;
+    vector<unsigned> _m0;
+    unsigned _nprocs;
+    unsigned long _maxfirings = 0;
+    vector<unsigned> _part;  // of each transition
+    vector<unsigned> _owner; // partition of each place
+    // Rings only link partitions sharing places, by index in _rings of the
+    // ring from*_nprocs+to
+    static constexpr unsigned NORING = UINT_MAX;
+    vector<unsigned> _ringidx;
+    unsigned _nrings = 0;
+    // Shared memory: Ctl, a PartCtl per partition, the rings, the marking
+    char *_shm = NULL;
+    size_t _shmlen = 0;
+    Ctl *_ctl;
+    PartCtl *_parts;
+    PNProcRing *_rings;
+    unsigned *_marking;
+
+    // Calls f(istrans, index, nodeid, name) for each place and transition
+    template<typename F> void forNodes(F f)
+    {
+        if ( &_cn == &_imagecn )
+        {
+            typedef PNImageHeader H;
+            auto nodes = _image.section<PNImageNode>(H::NODES);
+            auto names = _image.section<char>(H::NAMES);
+            unsigned np = 0, nt = 0;
+            for(uint64_t i=0; i<_image.count(H::NODES); i++)
+            {
+                bool istrans = nodes[i]._kind == PNImageNode::TRANSITION;
+                f(istrans, istrans ? nt++ : np++, i, string(names + nodes[i]._nameoff, nodes[i]._namelen));
+            }
+            return;
+        }
+        for(auto p:_cn._places) f(false, p->_idx, p->_nodeid, p->_name);
+        for(auto t:_cn._transitions) f(true, t->_idx, t->_nodeid, t->_name);
+    }
+    PNProcRing& ring(unsigned from, unsigned to) { return _rings[_ringidx[from * _nprocs + to]]; }
+    static size_t align(size_t n) { return ( n + 63 ) / 64 * 64; }
+    void mapShared()
+    {
+        size_t partoff = align(sizeof(Ctl)), ringoff = partoff + align(_nprocs * sizeof(PartCtl));
+        size_t markoff = ringoff + align((size_t) _nrings * sizeof(PNProcRing));
+        _shmlen = markoff + _cn.nplaces() * sizeof(unsigned);
+        _shm = (char*) mmap(NULL, _shmlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+        if ( _shm == MAP_FAILED )
+        {
+            cout << "PNProcSim : can't map " << _shmlen << " bytes of shared memory" << endl;
+            exit(1);
+        }
+        _ctl = new(_shm) Ctl();
+        _parts = (PartCtl*) ( _shm + partoff );
+        for(unsigned k=0; k<_nprocs; k++) new(&_parts[k]) PartCtl();
+        _rings = (PNProcRing*) ( _shm + ringoff );
+        for(unsigned i=0; i<_nrings; i++) new(&_rings[i]) PNProcRing();
+        _marking = (unsigned*) ( _shm + markoff );
+    }
+    // Whether all partitions were idle throughout while reading the message
+    // counts, which then are those of a moment where all were idle
+    bool dead()
+    {
+        vector<unsigned long> state(_nprocs);
+        for(unsigned k=0; k<_nprocs; k++)
+        {
+            state[k] = _parts[k]._state;
+            if ( state[k] % 2 == 0 ) return false;
+        }
+        unsigned long sent = 0, received = 0;
+        for(unsigned k=0; k<_nprocs; k++)
+        {
+            sent += _parts[k]._sent;
+            received += _parts[k]._received;
+        }
+        for(unsigned k=0; k<_nprocs; k++)
+            if ( _parts[k]._state != state[k] ) return false;
+        return sent == received;
+    }
+    void partition()
+    {
+        _part = _cn.partition(_nprocs);
+        _owner.assign(_cn.nplaces(), 0);
+        vector<unsigned> votes(_nprocs);
+        for(unsigned p=0; p<_cn.nplaces(); p++)
+        {
+            votes.assign(_nprocs, 0);
+            for(unsigned i=_cn._pooff[p]; i<_cn._pooff[p+1]; i++) votes[_part[_cn._potrans[i]]] += 2;
+            for(unsigned i=_cn._pioff[p]; i<_cn._pioff[p+1]; i++) votes[_part[_cn._pitrans[i]]]++;
+            _owner[p] = max_element(votes.begin(), votes.end()) - votes.begin();
+        }
+        // A transition reserves from (and hears the counts of) the owners of
+        // its input places, which answer, and deposits to those of its
+        // output places
+        vector<bool> talks(_nprocs * _nprocs, false);
+        for(unsigned t=0; t<_cn.ntransitions(); t++)
+        {
+            unsigned k = _part[t];
+            for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+                talks[k * _nprocs + _owner[_cn._tiplace[i]]] = talks[_owner[_cn._tiplace[i]] * _nprocs + k] = true;
+            for(unsigned i=_cn._tooff[t]; i<_cn._tooff[t+1]; i++)
+                talks[k * _nprocs + _owner[_cn._toplace[i]]] = true;
+        }
+        _ringidx.assign(_nprocs * _nprocs, NORING);
+        for(unsigned from=0; from<_nprocs; from++)
+            for(unsigned to=0; to<_nprocs; to++)
+                if ( from != to and talks[from * _nprocs + to] ) _ringidx[from * _nprocs + to] = _nrings++;
+        cout << "PNProcSim : " << _nprocs << " processes, " << _cn.sharedPlaces(_part) << " of "
+             << _cn.nplaces() << " places shared" << endl;
+    }
+    void setProcs()
+    {
+        char *nprocsvar = getenv("NPROCS");
+        _nprocs = nprocsvar ? stoi(nprocsvar) : 1;
+        if ( _nprocs == 0 ) _nprocs = 1;
+        cout << "PNProcSim : nProcs set to " << _nprocs << endl;
+    }
+public:
+    // Runs till the net is dead, a quit place gets a token or about
+    // maxfirings transitions have fired
+    PNProcResult run(unsigned long maxfirings=ULONG_MAX)
+    {
+        _maxfirings = maxfirings;
+        partition();
+        mapShared();
+        for(unsigned p=0; p<_cn.nplaces(); p++) _marking[p] = _m0[p];
+        cout.flush();
+        auto start = chrono::steady_clock::now();
+        vector<pid_t> pids;
+        for(unsigned k=0; k<_nprocs; k++)
+        {
+            pid_t pid = fork();
+            if ( pid == 0 )
+            {
+                {
+                    Partition part(*this, k);
+                    part.run();
+                }
+                // Skips the exit handlers and destructors of the parent's
+                // objects, e.g. the engine threads that weren't forked
+                _exit(0);
+            }
+            if ( pid < 0 )
+            {
+                cout << "PNProcSim : can't fork" << endl;
+                for(auto p:pids) kill(p, SIGKILL);
+                exit(1);
+            }
+            pids.push_back(pid);
+        }
+        // A partition stopping the run (quit place, limit) may exit before
+        // the stop is seen here, else it died
+        vector<bool> exited(_nprocs, false);
+        while ( not _ctl->_stop )
+        {
+            this_thread::sleep_for(chrono::microseconds(200));
+            if ( dead() ) _ctl->stop(PNProcResult::DEAD);
+            for(unsigned k=0; k<_nprocs; k++)
+            {
+                int status;
+                if ( exited[k] or waitpid(pids[k], &status, WNOHANG) == 0 ) continue;
+                exited[k] = true;
+                if ( _ctl->_stop and WIFEXITED(status) and WEXITSTATUS(status) == 0 ) continue;
+                cout << "PNProcSim : partition " << k << " died" << endl;
+                for(auto p:pids) kill(p, SIGKILL);
+                exit(1);
+            }
+        }
+        for(unsigned k=0; k<_nprocs; k++)
+            if ( not exited[k] ) waitpid(pids[k], NULL, 0);
+        PNProcResult result;
+        result._secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result._status = (PNProcResult::Status) ( _ctl->_stop - 1 );
+        result._marking.assign(_marking, _marking + _cn.nplaces());
+        for(unsigned k=0; k<_nprocs; k++)
+        {
+            auto stats = _parts[k]._stats;
+            stats._ntransitions = count(_part.begin(), _part.end(), k);
+            stats._nplaces = count(_owner.begin(), _owner.end(), k);
+            result._firings += stats._firings;
+            result._parts.push_back(stats);
+        }
+        munmap(_shm, _shmlen);
+        _shm = NULL;
+        return result;
+    }
+    // Runs start from the initial markings of places, unless given a marking
+    // (indexed by PNPlace::_idx) here
+    void setInitialMarking(vector<unsigned>& m0) { _m0 = m0; }
+    PNProcSim(PetriNetBase& pn) : _cn(pn.compiled()), _netname(pn._netname)
+    {
+        for(auto p:_cn._places) _m0.push_back(p->marking());
+        setProcs();
+    }
+    // Runs the net of an image (see PetriNetBase::saveImage) without
+    // building it: the image is mapped, and its compiled arrays viewed, by
+    // this process and then by the partitions, which share its pages
+    PNProcSim(string imagefile, string netname = "system") : _cn(_imagecn), _netname(netname)
+    {
+        typedef PNImageHeader H;
+        _image.open(imagefile);
+        _imagecn.view(_image);
+        auto nodes = _image.section<PNImageNode>(H::NODES);
+        for(uint64_t i=0; i<_image.count(H::NODES); i++)
+        {
+            if ( nodes[i]._nameoff + nodes[i]._namelen > _image.count(H::NAMES) )
+            {
+                cout << "PNImage : " << imagefile << " has a bad name of node " << i << endl;
+                exit(1);
+            }
+            if ( nodes[i]._kind != PNImageNode::TRANSITION ) _m0.push_back(nodes[i]._marking);
+        }
+        setProcs();
+    }
+};
+
+#endif
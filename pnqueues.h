@@ -0,0 +1,357 @@
+#ifndef _PNQUEUES_H
+#define _PNQUEUES_H
+
+// Containers used by the engines. The indexed containers hold transition
+// indices for the STPN scheduling modes, the indices are dense
+// (PNNode::_idx), so membership is tracked by a position array instead of
+// hashing. The queues pass items between threads without locks.
+
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <climits>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+
+using namespace std;
+
+// Set of indices in [0,n) with O(1) insert, remove and access by position,
+// hence O(1) uniform random pick. Elements are kept dense in _elems and
+// removal swaps the last element into the hole.
+class PNIndexedSet
+{
+    static constexpr unsigned NONE = UINT_MAX;
+    vector<unsigned> _elems;
+    vector<unsigned> _pos;
+public:
+    bool empty() { return _elems.empty(); }
+    unsigned size() { return _elems.size(); }
+    bool contains(unsigned e) { return _pos[e] != NONE; }
+    unsigned at(unsigned i) { return _elems[i]; }
+    // Inserting an element already present is a no-op
+    void insert(unsigned e)
+    {
+        if ( contains(e) ) return;
+        _pos[e] = _elems.size();
+        _elems.push_back(e);
+    }
+    void remove(unsigned e)
+    {
+        if ( not contains(e) ) return;
+        unsigned last = _elems.back();
+        _elems[_pos[e]] = last;
+        _pos[last] = _pos[e];
+        _elems.pop_back();
+        _pos[e] = NONE;
+    }
+    void resize(unsigned n) { _pos.assign(n, NONE); _elems.clear(); }
+};
+
+// Binary min heap of indices in [0,n) keyed by double, with a position array
+// so that the key of an element can be changed (either way) or the element
+// removed in O(log n). Each index is held at most once. Ties are broken by
+// the index for determinism.
+class PNIndexedHeap
+{
+    static constexpr unsigned NONE = UINT_MAX;
+    typedef pair<double, unsigned> Entry;
+    vector<Entry> _heap;
+    vector<unsigned> _pos;
+    void put(unsigned i, Entry e)
+    {
+        _heap[i] = e;
+        _pos[e.second] = i;
+    }
+    void siftup(unsigned i)
+    {
+        Entry e = _heap[i];
+        while ( i > 0 )
+        {
+            unsigned parent = ( i - 1 ) / 2;
+            if ( not ( e < _heap[parent] ) ) break;
+            put(i, _heap[parent]);
+            i = parent;
+        }
+        put(i, e);
+    }
+    void siftdown(unsigned i)
+    {
+        Entry e = _heap[i];
+        unsigned n = _heap.size();
+        while ( true )
+        {
+            unsigned child = 2 * i + 1;
+            if ( child >= n ) break;
+            if ( child + 1 < n and _heap[child+1] < _heap[child] ) child++;
+            if ( not ( _heap[child] < e ) ) break;
+            put(i, _heap[child]);
+            i = child;
+        }
+        put(i, e);
+    }
+public:
+    bool empty() { return _heap.empty(); }
+    unsigned size() { return _heap.size(); }
+    bool contains(unsigned e) { return _pos[e] != NONE; }
+    unsigned top() { return _heap[0].second; }
+    double topkey() { return _heap[0].first; }
+    double key(unsigned e) { return _heap[_pos[e]].first; }
+    // Inserts e, or changes its key if present
+    void set(unsigned e, double key)
+    {
+        if ( contains(e) )
+        {
+            unsigned i = _pos[e];
+            double oldkey = _heap[i].first;
+            _heap[i].first = key;
+            if ( key < oldkey ) siftup(i);
+            else siftdown(i);
+        }
+        else
+        {
+            _heap.push_back({key, e});
+            siftup(_heap.size() - 1);
+        }
+    }
+    void remove(unsigned e)
+    {
+        if ( not contains(e) ) return;
+        unsigned i = _pos[e];
+        _pos[e] = NONE;
+        Entry last = _heap.back();
+        _heap.pop_back();
+        if ( i == _heap.size() ) return;
+        put(i, last);
+        if ( i > 0 and last < _heap[( i - 1 ) / 2] ) siftup(i);
+        else siftdown(i);
+    }
+    void pop() { remove(top()); }
+    void resize(unsigned n) { _pos.assign(n, NONE); _heap.clear(); }
+};
+
+// Read only array which either owns its elements (built by push_back) or is
+// a view of memory owned elsewhere, e.g. a mapped file
+template<typename T> class PNArray
+{
+    vector<T> _own;
+    const T *_data = nullptr;
+    size_t _n = 0;
+public:
+    const T& operator[](size_t i) const { return _data[i]; }
+    size_t size() const { return _n; }
+    bool empty() const { return _n == 0; }
+    const T* data() const { return _data; }
+    const T* begin() const { return _data; }
+    const T* end() const { return _data + _n; }
+    void push_back(T v)
+    {
+        _own.push_back(v);
+        _data = _own.data();
+        _n = _own.size();
+    }
+    void view(const T *data, size_t n)
+    {
+        _own.clear();
+        _data = data;
+        _n = n;
+    }
+    PNArray() {}
+    PNArray(const PNArray& a) : _own(a._own), _data(a._own.empty() ? a._data : _own.data()), _n(a._n) {}
+    PNArray& operator=(const PNArray&) = delete;
+};
+
+// Multiple producer single consumer queue. Producers push lock free onto a
+// linked stack, the consumer detaches all pending items at once and gets them
+// in push order.
+template<typename T> class PNInbox
+{
+    struct Node
+    {
+        T _v;
+        Node *_next;
+    };
+    atomic<Node*> _head {nullptr};
+public:
+    // Any thread
+    void push(T v)
+    {
+        auto n = new Node {v, _head.load(memory_order_relaxed)};
+        while ( not _head.compare_exchange_weak(n->_next, n) );
+    }
+    bool empty() { return _head.load() == nullptr; }
+    // Consumer only, calls f on each pending item
+    template<typename F> void drain(F f)
+    {
+        Node *n = _head.exchange(nullptr), *rev = nullptr;
+        while ( n )
+        {
+            auto next = n->_next;
+            n->_next = rev;
+            rev = n;
+            n = next;
+        }
+        while ( rev )
+        {
+            auto next = rev->_next;
+            f(rev->_v);
+            delete rev;
+            rev = next;
+        }
+    }
+    ~PNInbox() { drain([](T&){}); }
+};
+
+// Per thread single producer single consumer rings feeding one consumer.
+// Any thread may push, each gets its own ring on its first push. The
+// consumer is handed contiguous spans of a ring's items, by a background
+// thread once started, or by flush. It's never called concurrently. Items of
+// one thread are consumed in the order pushed, items of different threads in
+// no particular order. A full ring makes its thread wait, no item is dropped.
+template<typename T> class PNThreadRings
+{
+    static constexpr unsigned RINGSIZE = 1 << 14; // a power of 2
+public:
+    class Ring
+    {
+    public:
+        alignas(64) atomic<unsigned long> _head {0}; // written by producer
+        alignas(64) atomic<unsigned long> _tail {0}; // written by consumer
+        T _buf[RINGSIZE];
+        // Slot of the producer's next item
+        T& next() { return _buf[_head.load(memory_order_relaxed) & (RINGSIZE-1)]; }
+    };
+private:
+    inline static atomic<unsigned> _cntr {0};
+    // Ids of the instances not destroyed yet
+    inline static mutex _livemutex;
+    inline static unordered_set<unsigned> _live;
+    // Rings of the calling thread by owner id (ids aren't reused, unlike
+    // addresses), and the last one looked up
+    inline static thread_local vector<pair<unsigned,Ring*>> _tlrings;
+    inline static thread_local pair<unsigned,Ring*> _tllast {~0u, NULL};
+    const unsigned _id = _cntr++;
+    vector<Ring*> _rings;
+    mutex _ringsmutex;
+    mutex _drainmutex;
+    function<void(T*, unsigned)> _consumer;
+    thread *_drainer = NULL;
+    atomic<bool> _stop {false};
+
+    Ring* ring()
+    {
+        if ( _tllast.first == _id ) return _tllast.second;
+        for(auto& r:_tlrings)
+            if ( r.first == _id )
+            {
+                _tllast = r;
+                return r.second;
+            }
+        auto r = new Ring();
+        {
+            const lock_guard<mutex> lock(_ringsmutex);
+            _rings.push_back(r);
+        }
+        // Rings of destroyed instances are gone, drop them so that the list
+        // stays as long as the number of live instances the thread pushed to
+        {
+            const lock_guard<mutex> lock(_livemutex);
+            _tlrings.erase(remove_if(_tlrings.begin(), _tlrings.end(),
+                                     [](pair<unsigned,Ring*>& r) { return not _live.count(r.first); }),
+                           _tlrings.end());
+        }
+        _tlrings.push_back({_id, r});
+        _tllast = _tlrings.back();
+        return r;
+    }
+    // Hands over whatever the rings hold, returns whether there was any
+    bool drain()
+    {
+        const lock_guard<mutex> lock(_drainmutex);
+        vector<Ring*> rings;
+        {
+            const lock_guard<mutex> lockr(_ringsmutex);
+            rings = _rings;
+        }
+        bool drained = false;
+        for(auto r:rings)
+        {
+            unsigned long tail = r->_tail.load(memory_order_relaxed);
+            unsigned long head = r->_head.load(memory_order_acquire);
+            if ( head == tail ) continue;
+            drained = true;
+            // At most two contiguous stretches, the second one on wrap around
+            unsigned long from = tail & (RINGSIZE-1), n = head - tail;
+            unsigned long n1 = min(n, RINGSIZE - from);
+            _consumer(&r->_buf[from], n1);
+            if ( n > n1 ) _consumer(&r->_buf[0], n - n1);
+            r->_tail.store(head, memory_order_release);
+        }
+        return drained;
+    }
+    void drainloop()
+    {
+        while ( not _stop )
+            if ( not drain() ) this_thread::sleep_for(chrono::milliseconds(1));
+    }
+public:
+    // Ring of the calling thread, once it has room for the next item, which
+    // is filled in place (Ring::next) and made visible to the consumer by
+    // publish
+    Ring* claim()
+    {
+        auto r = ring();
+        unsigned long head = r->_head.load(memory_order_relaxed);
+        while ( head - r->_tail.load(memory_order_acquire) == RINGSIZE ) this_thread::yield();
+        return r;
+    }
+    void publish(Ring* r)
+    {
+        r->_head.store(r->_head.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+    void push(const T& item)
+    {
+        auto r = claim();
+        r->next() = item;
+        publish(r);
+    }
+    // Hands all items pushed so far to the consumer
+    void flush()
+    {
+        if ( _consumer ) drain();
+    }
+    // Starts the background thread, to be called once before any push
+    void start(function<void(T*, unsigned)> consumer)
+    {
+        _consumer = consumer;
+        _drainer = new thread(&PNThreadRings::drainloop, this);
+    }
+    // Stops the background thread, the remaining items are still flushed
+    void stop()
+    {
+        if ( not _drainer ) return;
+        _stop = true;
+        _drainer->join();
+        delete _drainer;
+        _drainer = NULL;
+        flush();
+    }
+    PNThreadRings()
+    {
+        const lock_guard<mutex> lock(_livemutex);
+        _live.insert(_id);
+    }
+    ~PNThreadRings()
+    {
+        stop();
+        {
+            const lock_guard<mutex> lock(_livemutex);
+            _live.erase(_id);
+        }
+        for(auto r:_rings) delete r;
+    }
+};
+
+#endif
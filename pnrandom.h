@@ -0,0 +1,70 @@
+#ifndef _PNRANDOM_H
+#define _PNRANDOM_H
+
+// Fast, seedable pseudo random number generator for the randomized simulation
+// modes: xoshiro256** by Blackman and Vigna, seeded through splitmix64. Meets
+// the UniformRandomBitGenerator requirements, so it also works with the
+// <random> distributions.
+//
+// A run can be replayed exactly by passing the seed it reported, either
+// through the API or through the PNSEED environment variable.
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <random>
+
+using namespace std;
+
+class PNRandom
+{
+    uint64_t _s[4];
+    uint64_t _seed;
+    static uint64_t rotl(uint64_t x, int k) { return ( x << k ) | ( x >> ( 64 - k ) ); }
+public:
+    typedef uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+    // Advances x and returns the next splitmix64 output
+    static uint64_t splitmix64(uint64_t& x)
+    {
+        uint64_t z = ( x += 0x9E3779B97F4A7C15UL );
+        z = ( z ^ ( z >> 30 ) ) * 0xBF58476D1CE4E5B9UL;
+        z = ( z ^ ( z >> 27 ) ) * 0x94D049BB133111EBUL;
+        return z ^ ( z >> 31 );
+    }
+    // PNSEED if set, else a non deterministic seed
+    static uint64_t envSeed()
+    {
+        char *seedvar = getenv("PNSEED");
+        if ( seedvar ) return stoul(seedvar);
+        random_device rd;
+        return ( (uint64_t) rd() << 32 ) | rd();
+    }
+    void seed(uint64_t seed)
+    {
+        _seed = seed;
+        uint64_t x = seed;
+        for(auto& s:_s) s = splitmix64(x);
+    }
+    uint64_t getSeed() { return _seed; }
+    result_type operator()()
+    {
+        uint64_t result = rotl(_s[1] * 5, 7) * 9;
+        uint64_t t = _s[1] << 17;
+        _s[2] ^= _s[0];
+        _s[3] ^= _s[1];
+        _s[1] ^= _s[2];
+        _s[0] ^= _s[3];
+        _s[2] ^= t;
+        _s[3] = rotl(_s[3], 45);
+        return result;
+    }
+    // Uniform in [lo,hi) using the top 53 bits
+    double uniform(double lo, double hi) { return lo + ( hi - lo ) * ( ( (*this)() >> 11 ) * 0x1.0p-53 ); }
+    // Uniform in [0,n) by multiply and shift (Lemire), avoids a division
+    unsigned below(unsigned n) { return ( ( (*this)() >> 32 ) * n ) >> 32; }
+    PNRandom(uint64_t seed=envSeed()) { this->seed(seed); }
+};
+
+#endif
@@ -0,0 +1,487 @@
+#ifndef _PNREACH_H
+#define _PNREACH_H
+
+// Exhaustive (explicit state) exploration of the reachability graph of a net,
+// e.g. to find all deadlocks instead of hunting them by randomized runs.
+//
+// The net is built and frozen as usual, the explorer works on its compiled
+// structure. Like batch replicas, it explores the bare net: actions, arc
+// choosers and delays are not considered. A marking in which a quit place has
+// tokens ends a run, hence such states are not expanded.
+//
+// Markings are bit packed, each place taking just enough bits to hold the
+// token bound given (1 by default, i.e. safe nets). A marking exceeding the
+// bound stops the exploration as UNBOUNDED. States (packed marking, parent
+// state and the transition leading to it) are kept in a store of fixed size
+// segments. Once the store exceeds PNMEMLIMIT MB (environment variable,
+// default unlimited), further segments are mapped from a scratch file, so
+// that the kernel can page them out. The index over the states is a sharded
+// open addressing hash set holding 8 byte (fingerprint, id) entries, which
+// stays in memory.
+//
+// Exploration is breadth first, level by level, with each level split into
+// chunks expanded in parallel over NTHREADS workers. A deadlock is reported
+// with the firing sequence that leads to it from the initial marking, which
+// is a shortest one. With setReduction, only a stubborn set of the enabled
+// transitions is expanded in each state, which preserves the deadlocks while
+// skipping most interleavings of independent transitions.
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "petrinet.h"
+
+class PNReachResult
+{
+public:
+    typedef enum {COMPLETE,DEADLOCK,UNBOUNDED,LIMIT} Status;
+    Status _status = COMPLETE;
+    uint64_t _nstates = 0;
+    uint64_t _ndeadlocks = 0;
+    unsigned _nlevels = 0;
+    // For DEADLOCK, the transitions (by index) leading to the deadlock and
+    // the deadlocked marking. For UNBOUNDED, the sequence leading to the
+    // marking from which the bound gets exceeded, and that marking.
+    vector<unsigned> _trace;
+    vector<unsigned> _marking;
+    unsigned _unboundedPlace = UINT_MAX;
+    string statusstr()
+    {
+        switch(_status)
+        {
+            case COMPLETE  : return "COMPLETE";
+            case DEADLOCK  : return "DEADLOCK";
+            case UNBOUNDED : return "UNBOUNDED";
+            default        : return "LIMIT";
+        }
+    }
+};
+
+// Fixed size records in segments that never move, so that records can be
+// read while others are being added
+class PNStateStore
+{
+    static constexpr unsigned MAXSEGS = 1 << 16;
+    static constexpr uint64_t SEGBYTES = 64 << 20;
+    uint64_t _recbytes;
+    uint64_t _segrecs;
+    atomic<char*> _segs[MAXSEGS] {};
+    mutex _growmutex;
+    uint64_t _memlimit;
+    uint64_t _inmem = 0;
+    int _spillfd = -1;
+    uint64_t _spilled = 0; // segments in the scratch file
+
+    char* grow(uint64_t si)
+    {
+        const lock_guard<mutex> lock(_growmutex);
+        if ( _segs[si] ) return _segs[si];
+        if ( si >= MAXSEGS )
+        {
+            cout << "PNStateStore : out of segments" << endl;
+            exit(1);
+        }
+        void *seg;
+        if ( _inmem + SEGBYTES <= _memlimit )
+        {
+            seg = mmap(NULL, SEGBYTES, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            _inmem += SEGBYTES;
+        }
+        else
+        {
+            if ( _spillfd < 0 )
+            {
+                string tmpl = string(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp") + "/pnreach.XXXXXX";
+                _spillfd = mkstemp(&tmpl[0]);
+                // Removed right away, the space is freed once the file is closed
+                if ( _spillfd >= 0 ) unlink(tmpl.c_str());
+            }
+            if ( _spillfd < 0 or ftruncate(_spillfd, (_spilled+1) * SEGBYTES) != 0 )
+            {
+                cout << "PNStateStore : can't extend the scratch file" << endl;
+                exit(1);
+            }
+            seg = mmap(NULL, SEGBYTES, PROT_READ|PROT_WRITE, MAP_SHARED, _spillfd, _spilled * SEGBYTES);
+            _spilled++;
+        }
+        if ( seg == MAP_FAILED )
+        {
+            cout << "PNStateStore : out of memory" << endl;
+            exit(1);
+        }
+        _segs[si] = (char*) seg;
+        return (char*) seg;
+    }
+public:
+    char* rec(uint64_t id)
+    {
+        uint64_t si = id / _segrecs;
+        char *seg = _segs[si].load(memory_order_acquire);
+        if ( not seg ) seg = grow(si);
+        return seg + (id % _segrecs) * _recbytes;
+    }
+    uint64_t spilledBytes() { return _spilled * SEGBYTES; }
+    PNStateStore(uint64_t recbytes, uint64_t memlimit) :
+        _recbytes(recbytes), _segrecs(SEGBYTES / recbytes), _memlimit(memlimit) {}
+    ~PNStateStore()
+    {
+        for(auto& s:_segs) if ( s ) munmap(s, SEGBYTES);
+        if ( _spillfd >= 0 ) close(_spillfd);
+    }
+};
+
+class PNReachability : public MTEngine
+{
+    static constexpr unsigned NSHARDS = 256;
+    static constexpr unsigned CHUNK = 256; // states expanded per work item
+    static constexpr uint32_t NOPARENT = UINT32_MAX;
+    // A state record is the parent id, the transition and the packed marking
+    struct StateHdr
+    {
+        uint32_t _parent;
+        uint32_t _t;
+    };
+    class Shard
+    {
+    public:
+        mutex _mutex;
+        // (upper 32 bits of hash) << 32 | (id + 1), 0 for an empty slot
+        vector<uint64_t> _slots = vector<uint64_t>(1024, 0);
+        uint64_t _used = 0;
+    };
+
+    PNCompiledNet& _cn;
+    string _netname;
+    unsigned _bound;
+    vector<unsigned> _bitoff;   // of each place in a packed marking
+    unsigned _bits;             // per place
+    unsigned _words;            // per packed marking
+    PNStateStore *_store = NULL;
+    Shard _shards[NSHARDS];
+    atomic<uint64_t> _nstates {0};
+    uint64_t _maxstates;
+    bool _stopAtDeadlock;
+    bool _reduce = false;
+
+    vector<uint32_t> _cur, _next;
+    mutex _nextmutex;
+    atomic<unsigned> _pending {0};
+    atomic<bool> _stop {false};
+    mutex _resultmutex;
+    PNReachResult _result;
+
+    uint64_t* words(uint32_t id) { return (uint64_t*) (_store->rec(id) + sizeof(StateHdr)); }
+    StateHdr* hdr(uint32_t id) { return (StateHdr*) _store->rec(id); }
+    void setfield(uint64_t *w, unsigned p, uint64_t v)
+    {
+        unsigned off = _bitoff[p];
+        uint64_t mask = ( 1UL << _bits ) - 1;
+        w[off/64] = ( w[off/64] & ~( mask << (off%64) ) ) | v << (off%64);
+        if ( off%64 + _bits > 64 )
+            w[off/64+1] = ( w[off/64+1] & ~( mask >> (64 - off%64) ) ) | v >> (64 - off%64);
+    }
+    void pack(vector<unsigned>& m, vector<uint64_t>& w)
+    {
+        fill(w.begin(), w.end(), 0);
+        for(unsigned p=0; p<m.size(); p++) setfield(w.data(), p, m[p]);
+    }
+    void unpack(uint64_t *w, vector<unsigned>& m)
+    {
+        uint64_t mask = ( 1UL << _bits ) - 1;
+        for(unsigned p=0; p<m.size(); p++)
+        {
+            unsigned off = _bitoff[p];
+            uint64_t v = w[off/64] >> (off%64);
+            if ( off%64 + _bits > 64 ) v |= w[off/64+1] << (64 - off%64);
+            m[p] = v & mask;
+        }
+    }
+    static uint64_t hash(vector<uint64_t>& w)
+    {
+        uint64_t h = 0x9E3779B97F4A7C15UL;
+        for(auto x:w)
+        {
+            h ^= x + 0x9E3779B97F4A7C15UL + (h << 6) + (h >> 2);
+            h *= 0xBF58476D1CE4E5B9UL;
+        }
+        return h ^ (h >> 31);
+    }
+    // Adds the state if not seen, returns its id and whether it's new
+    pair<uint32_t,bool> insert(vector<uint64_t>& w, uint32_t parent, unsigned t)
+    {
+        uint64_t h = hash(w);
+        uint64_t fp = h >> 32;
+        auto& shard = _shards[h % NSHARDS];
+        const lock_guard<mutex> lock(shard._mutex);
+        uint64_t mask = shard._slots.size() - 1;
+        for(uint64_t i = fp & mask; ; i = (i+1) & mask)
+        {
+            uint64_t e = shard._slots[i];
+            if ( e == 0 )
+            {
+                uint64_t id = _nstates++;
+                if ( id >= _maxstates or id >= NOPARENT )
+                {
+                    _nstates--;
+                    limit();
+                    return {NOPARENT, false};
+                }
+                *hdr(id) = {parent, t};
+                memcpy(words(id), w.data(), _words * 8);
+                shard._slots[i] = fp << 32 | (id + 1);
+                if ( ++shard._used * 2 > shard._slots.size() ) rehash(shard);
+                return {(uint32_t) id, true};
+            }
+            uint32_t id = (uint32_t) e - 1;
+            if ( e >> 32 == fp and memcmp(words(id), w.data(), _words * 8) == 0 ) return {id, false};
+        }
+    }
+    void rehash(Shard& shard)
+    {
+        vector<uint64_t> slots(shard._slots.size() * 2, 0);
+        uint64_t mask = slots.size() - 1;
+        for(auto e:shard._slots)
+            if ( e )
+            {
+                uint64_t i = (e >> 32) & mask;
+                while ( slots[i] ) i = (i+1) & mask;
+                slots[i] = e;
+            }
+        shard._slots.swap(slots);
+    }
+    vector<unsigned> traceTo(uint32_t id)
+    {
+        vector<unsigned> trace;
+        for(; hdr(id)->_parent != NOPARENT; id = hdr(id)->_parent) trace.push_back(hdr(id)->_t);
+        reverse(trace.begin(), trace.end());
+        return trace;
+    }
+    // The state store is full, what was explored so far is kept
+    void limit()
+    {
+        const lock_guard<mutex> lock(_resultmutex);
+        if ( _result._status == PNReachResult::COMPLETE ) _result._status = PNReachResult::LIMIT;
+        _stop = true;
+    }
+    // The first deadlock found is reported, unless the net turns out to be
+    // unbounded
+    void found(PNReachResult::Status status, uint32_t id, vector<unsigned>& m, unsigned place=UINT_MAX)
+    {
+        const lock_guard<mutex> lock(_resultmutex);
+        if ( status == PNReachResult::DEADLOCK ) _result._ndeadlocks++;
+        if ( _result._status == PNReachResult::COMPLETE or _result._status == PNReachResult::LIMIT
+             or ( status == PNReachResult::UNBOUNDED and _result._status == PNReachResult::DEADLOCK ) )
+        {
+            _result._status = status;
+            _result._trace = traceTo(id);
+            _result._marking = m;
+            _result._unboundedPlace = place;
+        }
+        if ( status == PNReachResult::UNBOUNDED or _stopAtDeadlock ) _stop = true;
+    }
+    bool enabled(vector<unsigned>& m, unsigned t)
+    {
+        for(unsigned j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++)
+            if ( m[_cn._tiplace[j]] < _cn._tiwt[j] ) return false;
+        return true;
+    }
+    // Enabled transitions of the stubborn set grown from seed (enabled) into
+    // out. For an enabled transition, the set takes all transitions that
+    // consume from its input places (they may disable it or be disabled by
+    // it). For a disabled one, all producers of one of its insufficiently
+    // marked input places, the one with fewest producers (nothing else can
+    // enable it). Gives up, returning false, once out holds limit transitions.
+    bool stubborn(vector<unsigned>& m, unsigned seed, unsigned limit, vector<unsigned>& mark, unsigned stamp,
+                  vector<unsigned>& stack, vector<unsigned>& out)
+    {
+        out.clear();
+        stack.assign(1, seed);
+        mark[seed] = stamp;
+        auto add = [&](unsigned t)
+        {
+            if ( mark[t] == stamp ) return;
+            mark[t] = stamp;
+            stack.push_back(t);
+        };
+        while ( not stack.empty() )
+        {
+            unsigned t = stack.back();
+            stack.pop_back();
+            if ( enabled(m, t) )
+            {
+                if ( out.size() + 1 >= limit ) return false;
+                out.push_back(t);
+                for(unsigned j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++)
+                {
+                    unsigned p = _cn._tiplace[j];
+                    for(unsigned k=_cn._pooff[p]; k<_cn._pooff[p+1]; k++) add(_cn._potrans[k]);
+                }
+            }
+            else
+            {
+                unsigned scapegoat = UINT_MAX;
+                for(unsigned j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++)
+                {
+                    unsigned p = _cn._tiplace[j];
+                    if ( m[p] < _cn._tiwt[j] and ( scapegoat == UINT_MAX or
+                         _cn._pioff[p+1] - _cn._pioff[p] < _cn._pioff[scapegoat+1] - _cn._pioff[scapegoat] ) )
+                        scapegoat = p;
+                }
+                for(unsigned k=_cn._pioff[scapegoat]; k<_cn._pioff[scapegoat+1]; k++) add(_cn._pitrans[k]);
+            }
+        }
+        return true;
+    }
+    void expand(unsigned from, unsigned to)
+    {
+        vector<unsigned> m(_cn.nplaces()), succ(_cn.nplaces());
+        vector<uint64_t> w(_words), parent(_words);
+        vector<uint32_t> fresh;
+        vector<unsigned> en, best, mark, stack, out;
+        unsigned stamp = 0;
+        if ( _reduce ) mark.assign(_cn.ntransitions(), 0);
+        for(unsigned i=from; i<to and not _stop; i++)
+        {
+            uint32_t id = _cur[i];
+            memcpy(parent.data(), words(id), _words * 8);
+            unpack(parent.data(), m);
+            succ = m;
+            w = parent;
+            bool quit = false;
+            for(unsigned p=0; p<m.size(); p++) quit = quit or ( m[p] and _cn._isquit[p] );
+            if ( quit ) continue;
+            en.clear();
+            for(unsigned t=0; t<_cn.ntransitions(); t++)
+                if ( enabled(m, t) ) en.push_back(t);
+            if ( en.empty() ) found(PNReachResult::DEADLOCK, id, m);
+            // Smallest stubborn set over all seeds
+            if ( _reduce and en.size() > 1 )
+            {
+                best = en;
+                for(auto seed:en)
+                {
+                    if ( stubborn(m, seed, best.size(), mark, ++stamp, stack, out) ) best.swap(out);
+                    if ( best.size() == 1 ) break;
+                }
+                en.swap(best);
+            }
+            for(auto t:en)
+            {
+                if ( _stop ) break;
+                // The successor differs from m only in the places t touches
+                unsigned j;
+                for(j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++) succ[_cn._tiplace[j]] -= _cn._tiwt[j];
+                for(j=_cn._tooff[t]; j<_cn._tooff[t+1]; j++) succ[_cn._toplace[j]] += _cn._towt[j];
+                unsigned over = UINT_MAX;
+                for(j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++) setfield(w.data(), _cn._tiplace[j], succ[_cn._tiplace[j]]);
+                for(j=_cn._tooff[t]; j<_cn._tooff[t+1]; j++)
+                {
+                    unsigned p = _cn._toplace[j];
+                    if ( succ[p] > _bound ) over = p;
+                    else setfield(w.data(), p, succ[p]);
+                }
+                // Back to m for the next transition
+                for(j=_cn._tioff[t]; j<_cn._tioff[t+1]; j++) succ[_cn._tiplace[j]] = m[_cn._tiplace[j]];
+                for(j=_cn._tooff[t]; j<_cn._tooff[t+1]; j++) succ[_cn._toplace[j]] = m[_cn._toplace[j]];
+                if ( over != UINT_MAX )
+                {
+                    found(PNReachResult::UNBOUNDED, id, m, over);
+                    break;
+                }
+                auto ins = insert(w, id, t);
+                if ( ins.second ) fresh.push_back(ins.first);
+                w = parent;
+            }
+        }
+        {
+            const lock_guard<mutex> lock(_nextmutex);
+            _next.insert(_next.end(), fresh.begin(), fresh.end());
+        }
+        if ( --_pending == 0 ) startLevel();
+    }
+    // Called once the previous level is done, by the worker that finished it
+    void startLevel()
+    {
+        _cur.swap(_next);
+        _next.clear();
+        if ( _cur.empty() or _stop ) return;
+        _result._nlevels++;
+        unsigned nchunks = (_cur.size() + CHUNK - 1) / CHUNK;
+        _pending = nchunks;
+        for(unsigned c=0; c<nchunks; c++) addtask(0, c);
+    }
+    // Expands chunk c of the current level
+    void runTask(unsigned op, unsigned c) { expand(c * CHUNK, min((unsigned) _cur.size(), (c+1) * CHUNK)); }
+public:
+    // Explores only the successors by the enabled transitions of a stubborn
+    // set of each state, i.e. one of the interleavings of independent
+    // transitions instead of all of them. All the deadlocks are still found,
+    // but not all the other states nor necessarily the shortest sequences.
+    // States with tokens in a quit place may be missed.
+    void setReduction(bool reduce) { _reduce = reduce; }
+    // Single use, like an MTEngine: construct, then call explore once.
+    // maxstates bounds the states stored (LIMIT if reached). If
+    // stopAtDeadlock is false, all deadlocks are counted and the first one
+    // found is reported.
+    PNReachResult explore(uint64_t maxstates = UINT32_MAX, bool stopAtDeadlock = true)
+    {
+        _maxstates = maxstates;
+        _stopAtDeadlock = stopAtDeadlock;
+        vector<unsigned> m0;
+        for(auto p:_cn._places) m0.push_back(p->marking());
+        vector<uint64_t> w(_words);
+        for(unsigned p=0; p<m0.size(); p++)
+            if ( m0[p] > _bound )
+            {
+                _result._status = PNReachResult::UNBOUNDED;
+                _result._marking = m0;
+                _result._unboundedPlace = p;
+                return _result;
+            }
+        pack(m0, w);
+        _next.push_back(insert(w, NOPARENT, 0).first);
+        startLevel();
+        wait();
+        _result._nstates = _nstates;
+        return _result;
+    }
+    // Prints the result, with the firing sequence leading to the deadlock (or
+    // to the bound getting exceeded) and the marking reached
+    void printResult(PNReachResult& r, ostream& os = cout)
+    {
+        os << "PN_REACH:" << _netname << ":" << r.statusstr() << ":states=" << r._nstates
+           << ":levels=" << r._nlevels << ":deadlocks=" << r._ndeadlocks;
+        if ( _store->spilledBytes() ) os << ":spilledMB=" << (_store->spilledBytes() >> 20);
+        os << endl;
+        for(auto t:r._trace) os << "t:" << _cn._transitions[t]->idlabel() << endl;
+        if ( r._unboundedPlace != UINT_MAX ) os << "unbounded:" << _cn._places[r._unboundedPlace]->idlabel() << endl;
+        for(unsigned p=0; p<r._marking.size(); p++)
+            if ( r._marking[p] ) os << "p:" << _cn._places[p]->idlabel() << ":" << r._marking[p] << endl;
+    }
+    // bound is the most tokens a place may hold
+    PNReachability(PetriNetBase& pn, unsigned bound=1) : _cn(pn.compiled()), _netname(pn._netname), _bound(bound)
+    {
+        _bits = 1;
+        while ( _bits < 32 and ( 1UL << _bits ) <= bound ) _bits++;
+        for(unsigned p=0; p<_cn.nplaces(); p++) _bitoff.push_back(p * _bits);
+        _words = max(1U, ( _cn.nplaces() * _bits + 63 ) / 64);
+        char *memlimitvar = getenv("PNMEMLIMIT");
+        uint64_t memlimit = memlimitvar ? stoull(memlimitvar) << 20 : UINT64_MAX;
+        _store = new PNStateStore(sizeof(StateHdr) + _words * 8, memlimit);
+    }
+    ~PNReachability()
+    {
+        shutdown();
+        delete _store;
+    }
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _PNREPLAY_H
+#define _PNREPLAY_H
+
+// Re-drives a net through the firing sequence recorded in a trace (see
+// pntrace.h), e.g. to reproduce an interleaving seen in a multithreaded run.
+//
+// Build the net on a PNReplayNet exactly as it was built for the traced run,
+// so that nodes get the same ids, and call replay instead of init and wait.
+// The traced transitions fire one at a time in the traced order on the
+// calling thread, with their actions, so the run is deterministic. Tokens
+// added by actions are deposited right away, just like the outputs of the
+// fired transitions.
+
+#include "petrinet.h"
+#include "pntrace.h"
+
+class PNReplayNet : public PetriNetBase
+{
+using PetriNetBase::PetriNetBase;
+    void deposit(unsigned p, unsigned newtokens)
+    {
+        _tokens[p] += newtokens;
+#       ifdef PN_PLACE_CAPACITY_EXCEPTION
+        checkPlaceCapacityException(p);
+#       endif
+        _cn._places[p]->addactions(newtokens);
+    }
+    bool enabled(unsigned t)
+    {
+        for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+            if ( _tokens[_cn._tiplace[i]] < _cn._tiwt[i] ) return false;
+        return true;
+    }
+    void checkNodes(vector<pair<unsigned,string>>& traced, vector<PNNode*> nodes)
+    {
+        bool same = traced.size() == nodes.size();
+        for(unsigned i=0; same and i<nodes.size(); i++)
+            same = traced[i].first == nodes[i]->_nodeid and traced[i].second == nodes[i]->_name;
+        if ( not same )
+        {
+            cout << "PNReplayNet : the net doesn't match the traced net" << endl;
+            exit(1);
+        }
+    }
+public:
+    // Fires the traced transitions with seqno below upto (all by default),
+    // returns the number fired. Stops early on a quit place getting a token,
+    // or if a traced transition isn't enabled, in which case
+    // PN_REPLAY_DIVERGED:<seqno>:<transition> is printed.
+    uint64_t replay(PNTrace& trace, uint64_t upto = UINT64_MAX)
+    {
+        freeze();
+        checkNodes(trace._places, vector<PNNode*>(_cn._places.begin(), _cn._places.end()));
+        checkNodes(trace._transitions, vector<PNNode*>(_cn._transitions.begin(), _cn._transitions.end()));
+        init();
+        uint64_t fired = 0;
+        trace.forFirings(0, [&](uint64_t seqno, PNTraceFiring f)
+        {
+            if ( seqno >= upto or _quit ) return false;
+            if ( not enabled(f._t) )
+            {
+                cout << "PN_REPLAY_DIVERGED:" << seqno << ":" << _cn._transitions[f._t]->idlabel() << endl;
+                return false;
+            }
+            for(unsigned i=_cn._tioff[f._t]; i<_cn._tioff[f._t+1]; i++)
+                _tokens[_cn._tiplace[i]] -= _cn._tiwt[i];
+            fire(f._t);
+            fired++;
+            return true;
+        });
+        return fired;
+    }
+    ~PNReplayNet() { shutdown(); }
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef _PNSTATIC_H
+#define _PNSTATIC_H
+
+// Nets fixed at build time, described as constexpr data, run by an engine
+// specialized for the net by the compiler: the input checks and token
+// updates of each transition are unrolled over its arcs, and the actions
+// are templates called directly, so there are no virtual calls, no
+// std::function and no heap allocated nodes or arcs on the firing path.
+//
+//     constexpr auto net = makeStaticNet(
+//         {{"idle",1}, {"busy"}},                 // places: name, marking, quit
+//         {{"start"}, {"stop"}},                  // transitions
+//         {{"idle","start"}, {"start","busy"},    // arcs: from, to, weight
+//          {"busy","stop"}, {"stop","idle"}});
+//     struct Actions : PNStaticNoActions
+//     {
+//         template<unsigned T, typename E> void fired(E& e, unsigned long seqno)
+//         {
+//             if constexpr ( T == net.transition("stop") ) e.quit();
+//         }
+//     };
+//     Actions actions;
+//     PNStaticEngine<net, Actions> engine(actions);
+//     engine.run();
+//
+// Node names are resolved at compile time, an unknown name fails the build.
+// The engine runs on the calling thread. Enabled transitions fire in index
+// order, i.e. as STPetriNet does for transitions of equal delay, delays and
+// arc choosers aren't supported. The net can still be exported with the
+// usual printers, via a mirror built on a PetriNetBase.
+
+#include <array>
+#include <utility>
+#include <climits>
+#include "petrinet.h"
+
+class PNStaticPlace
+{
+public:
+    const char *_name = "";
+    unsigned _marking = 0;
+    bool _quit = false; // a PNQuitPlace
+};
+
+class PNStaticTransition
+{
+public:
+    const char *_name = "";
+};
+
+class PNStaticArc
+{
+public:
+    const char *_from = "";
+    const char *_to = "";
+    unsigned _weight = 1;
+};
+
+template<size_t NP_, size_t NT_, size_t NA_> class PNStaticNet
+{
+    static constexpr bool equal(const char *l, const char *r)
+    {
+        while ( *l and *l == *r )
+        {
+            l++;
+            r++;
+        }
+        return *l == *r;
+    }
+    static constexpr unsigned NONE = UINT_MAX;
+public:
+    static constexpr size_t NP = NP_, NT = NT_, NA = NA_;
+    // Arc resolved to node indices
+    class Arc
+    {
+    public:
+        unsigned _p = 0;
+        unsigned _t = 0;
+        unsigned _weight = 0;
+        bool _input = false; // place to transition
+    };
+    array<PNStaticPlace, NP> _places;
+    array<PNStaticTransition, NT> _transitions;
+    array<Arc, NA> _arcs;
+    constexpr unsigned find(const char *name, bool isplace) const
+    {
+        if ( isplace )
+        {
+            for(unsigned i=0; i<NP; i++) if ( equal(_places[i]._name, name) ) return i;
+        }
+        else
+            for(unsigned i=0; i<NT; i++) if ( equal(_transitions[i]._name, name) ) return i;
+        return NONE;
+    }
+    // Index of a node by name, usable as a template argument
+    constexpr unsigned place(const char *name) const
+    {
+        auto i = find(name, true);
+        return i != NONE ? i : throw "PNStaticNet : unknown place";
+    }
+    constexpr unsigned transition(const char *name) const
+    {
+        auto i = find(name, false);
+        return i != NONE ? i : throw "PNStaticNet : unknown transition";
+    }
+    // Number of input (or output) arcs of transition t
+    constexpr unsigned narcs(unsigned t, bool input) const
+    {
+        unsigned n = 0;
+        for(auto& a:_arcs) n += a._t == t and a._input == input;
+        return n;
+    }
+    constexpr PNStaticNet(const PNStaticPlace (&places)[NP], const PNStaticTransition (&transitions)[NT],
+                          const PNStaticArc (&arcs)[NA]) : _places(), _transitions(), _arcs()
+    {
+        for(unsigned i=0; i<NP; i++) _places[i] = places[i];
+        for(unsigned i=0; i<NT; i++) _transitions[i] = transitions[i];
+        for(unsigned i=0; i<NA; i++)
+        {
+            auto& a = _arcs[i];
+            a._weight = arcs[i]._weight;
+            a._input = find(arcs[i]._from, true) != NONE;
+            a._p = a._input ? place(arcs[i]._from) : place(arcs[i]._to);
+            a._t = a._input ? transition(arcs[i]._to) : transition(arcs[i]._from);
+        }
+    }
+};
+
+template<size_t NP, size_t NT, size_t NA>
+constexpr auto makeStaticNet(const PNStaticPlace (&places)[NP], const PNStaticTransition (&transitions)[NT],
+                             const PNStaticArc (&arcs)[NA])
+{
+    return PNStaticNet<NP, NT, NA>(places, transitions, arcs);
+}
+
+// Actions are called on the engine's thread with the node index as template
+// argument. Derive from this and define the ones needed.
+class PNStaticNoActions
+{
+public:
+    // Transition T fired, after its output tokens were added
+    template<unsigned T, typename E> void fired(E&, unsigned long) {}
+    // Tokens were added to place P
+    template<unsigned P, typename E> void added(E&, unsigned) {}
+};
+
+template<const auto& Net, typename Actions = PNStaticNoActions> class PNStaticEngine
+{
+    typedef decay_t<decltype(Net)> NetT;
+    static constexpr unsigned NP = NetT::NP, NT = NetT::NT;
+    typedef typename NetT::Arc Arc;
+
+    Actions& _actions;
+    string _netname;
+    array<unsigned, NP> _tokens;
+    unsigned long _eseqno = 0;
+    bool _quit = false;
+
+    // Input (or output) arcs of transition T
+    template<unsigned T, bool INPUT> static constexpr auto arcs()
+    {
+        array<Arc, Net.narcs(T, INPUT)> ret {};
+        unsigned n = 0;
+        for(auto& a:Net._arcs) if ( a._t == T and a._input == INPUT ) ret[n++] = a;
+        return ret;
+    }
+    template<unsigned T, size_t... I> bool enabled(index_sequence<I...>)
+    {
+        static constexpr auto in = arcs<T, true>();
+        return ( ( _tokens[in[I]._p] >= in[I]._weight ) and ... );
+    }
+    template<unsigned P> void add(unsigned n)
+    {
+        _tokens[P] += n;
+        if constexpr ( Net._places[P]._quit ) _quit = true;
+        _actions.template added<P>(*this, n);
+    }
+    template<unsigned T, size_t... I, size_t... O> void fire(index_sequence<I...>, index_sequence<O...>)
+    {
+        static constexpr auto in = arcs<T, true>();
+        static constexpr auto out = arcs<T, false>();
+        ( ( _tokens[in[I]._p] -= in[I]._weight ), ... );
+        ( add<out[O]._p>(out[O]._weight), ... );
+        _actions.template fired<T>(*this, _eseqno++);
+    }
+    template<unsigned T> bool tryFire()
+    {
+        constexpr unsigned nin = Net.narcs(T, true), nout = Net.narcs(T, false);
+        if ( not enabled<T>(make_index_sequence<nin>()) ) return false;
+        fire<T>(make_index_sequence<nin>(), make_index_sequence<nout>());
+        return true;
+    }
+    // Fires the first enabled transition, if any
+    template<size_t... T> bool step(index_sequence<T...>)
+    {
+        return ( tryFire<T>() or ... );
+    }
+    template<size_t... P> void addtokens(unsigned p, unsigned n, index_sequence<P...>)
+    {
+        ( ( p == P ? add<P>(n) : void() ), ... );
+    }
+public:
+    // Fires transitions till the net is dead, a quit place gets tokens, quit
+    // is called or maxfirings are done. Returns the number of firings. May be
+    // called again, e.g. after adding tokens.
+    unsigned long run(unsigned long maxfirings = ULONG_MAX)
+    {
+        unsigned long n = 0;
+        while ( n < maxfirings and not _quit and step(make_index_sequence<NT>()) ) n++;
+        if ( not _quit and n < maxfirings ) cout << "PN_DEAD:" << _netname << endl;
+        return n;
+    }
+    void quit() { _quit = true; }
+    unsigned tokens(unsigned p) { return _tokens[p]; }
+    void addtokens(unsigned p, unsigned n)
+    {
+        addtokens(p, n, make_index_sequence<NP>());
+    }
+    void printMarkings()
+    {
+        for(unsigned p=0; p<NP; p++)
+            cout << "MARKING:" << Net._places[p]._name << ":" << _tokens[p] << endl;
+    }
+    // Builds the same net on pn, e.g. to export it
+    void mirror(IPetriNet& pn)
+    {
+        vector<PNPlace*> places;
+        vector<PNTransition*> transitions;
+        for(auto& p:Net._places)
+            places.push_back(p._quit ? pn.createQuitPlace(p._name, p._marking) : pn.createPlace(p._name, p._marking));
+        for(auto& t:Net._transitions) transitions.push_back(pn.createTransition(t._name));
+        for(auto& a:Net._arcs)
+        {
+            if ( a._input ) pn.createArc(places[a._p], transitions[a._t], "", a._weight);
+            else pn.createArc(transitions[a._t], places[a._p], "", a._weight);
+        }
+    }
+    // Exports through the printers of PetriNetBase
+    void printdot(string filename="petri.dot") { export_([&](MTPetriNet& pn){ pn.printdot(filename); }); }
+    void printpnml(string filename="petri.pnml") { export_([&](MTPetriNet& pn){ pn.printpnml(filename); }); }
+    void printjson(string filename="petri.json") { export_([&](MTPetriNet& pn){ pn.printjson(filename); }); }
+    template<typename F> void export_(F f)
+    {
+        MTPetriNet pn(_netname);
+        mirror(pn);
+        f(pn);
+        pn.deleteElems();
+    }
+    PNStaticEngine(Actions& actions, string netname = "system") : _actions(actions), _netname(netname)
+    {
+        for(unsigned p=0; p<NP; p++) _tokens[p] = Net._places[p]._marking;
+        for(unsigned p=0; p<NP; p++) _quit = _quit or ( Net._places[p]._quit and _tokens[p] );
+    }
+};
+
+#endif
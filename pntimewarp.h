@@ -0,0 +1,604 @@
+#ifndef _PNTIMEWARP_H
+#define _PNTIMEWARP_H
+
+// Parallel timed simulation of a net with the firing semantics of STPetriNet
+// in SIMU_MODE_STPN, by optimistic (Time Warp) logical processes, one per
+// worker thread (NTHREADS).
+//
+// As in STPetriNet, a transition getting enabled at time T is scheduled at
+// T + its delay (see PNTransition::setDelayFn), is descheduled if disabled
+// before that, and the transition scheduled first fires first, ties going to
+// the lower transition index. A transition still enabled after firing is
+// scheduled afresh. Delays must be positive (a zero delay ends the run with
+// an error), so that the firings follow the order of their schedules.
+//
+// The transitions are partitioned over the logical processes (LPs) as for
+// MTPetriNet::setAffinity, except that all consumers of a place go to the
+// same LP, which owns the place. Firings of an LP hence never take tokens of
+// another one, LPs interact only by the tokens a firing deposits into places
+// of another LP, sent as a message stamped with the firing's time and
+// transition index. Each LP runs its firings and the deposits it receives in
+// stamp order, optimistically: a message stamped earlier than events already
+// run (a straggler) rolls the LP back to the stamp, undoing the events after
+// it from an undo log and cancelling the messages they sent by
+// anti-messages. With deterministic delays a run fires the same transitions
+// at the same times as STPetriNet does.
+//
+// Every so many events (see setWindow), or when all are idle, the LPs stop
+// for a global virtual time (GVT) round: the messages in transit are
+// received, and GVT is the earliest stamp of any event not yet run. Events
+// before GVT can't be rolled back any more, they are committed, which is when
+// the enabled actions of the transitions fired run (the actions of different
+// LPs concurrently). During the actions, now() is the time of the firing.
+// Since events may run more than once, delay functions may be called more
+// often than firings happen, concurrently from the LPs, and must be thread
+// safe. Actions must not add tokens to the net. Arc choosers and the actions
+// of places other than quit places are ignored.
+//
+// The run ends when the net is dead, when a quit place gets a token (the
+// firing that put it is the last one) or once the next firing would be after
+// the given end time.
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <limits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "petrinet.h"
+
+class PNTimeWarpStats
+{
+public:
+    unsigned _ntransitions = 0, _nplaces = 0; // owned
+    unsigned long _firings = 0; // committed
+    unsigned long _events = 0;  // run, including those rolled back
+    unsigned long _rolledback = 0, _rollbacks = 0;
+    unsigned long _msgs = 0, _antimsgs = 0; // sent
+};
+
+class PNTimeWarpResult
+{
+public:
+    typedef enum {DEAD,QUIT,LIMIT} Status;
+    Status _status = DEAD;
+    unsigned long _firings = 0;
+    double _time = 0; // of the last firing
+    double _secs = 0;
+    vector<unsigned> _marking;
+    vector<PNTimeWarpStats> _lps;
+    string statusstr()
+    {
+        switch(_status)
+        {
+            case DEAD : return "DEAD";
+            case QUIT : return "QUIT";
+            default   : return "LIMIT";
+        }
+    }
+    // A line per LP with its firing, rollback and message rates, and a total
+    void print(ostream& os)
+    {
+        unsigned long rolledback = 0, msgs = 0;
+        for(unsigned k=0; k<_lps.size(); k++)
+        {
+            auto& s = _lps[k];
+            rolledback += s._rolledback;
+            msgs += s._msgs + s._antimsgs;
+            os << "PN_TW:" << k << ":transitions=" << s._ntransitions << ":places=" << s._nplaces
+               << ":firings=" << s._firings << ":firings_per_sec=" << (unsigned long) ( s._firings / _secs )
+               << ":events=" << s._events << ":rolledback=" << s._rolledback << ":rollbacks=" << s._rollbacks
+               << ":msgs=" << s._msgs << ":antimsgs=" << s._antimsgs
+               << ":msgs_per_sec=" << (unsigned long) ( ( s._msgs + s._antimsgs ) / _secs ) << endl;
+        }
+        os << "PN_TW:total:" << statusstr() << ":firings=" << _firings << ":time=" << _time << ":secs=" << _secs
+           << ":firings_per_sec=" << (unsigned long) ( _firings / _secs ) << ":rolledback=" << rolledback
+           << ":msgs_per_sec=" << (unsigned long) ( msgs / _secs ) << endl;
+    }
+};
+
+// Single use: construct, then call run once
+class PNTimeWarp : public MTEngine
+{
+    static constexpr double NEVER = numeric_limits<double>::infinity();
+    // Events are run in order of time, then transition index: of the
+    // transition fired, or of the one whose firing sent the message
+    class Key
+    {
+    public:
+        double _time;
+        unsigned _t;
+        bool operator<(const Key& k) const { return _time < k._time or ( _time == k._time and _t < k._t ); }
+        bool operator<=(const Key& k) const { return not ( k < *this ); }
+    };
+    // Tokens deposited by a firing into places of another LP, or the
+    // anti-message cancelling the message of the same id
+    class Msg
+    {
+    public:
+        Key _key;
+        unsigned long _id;
+        bool _anti = false;
+        bool _processed = false;
+        vector<pair<unsigned,unsigned>> _deposits; // place, tokens
+    };
+    // The last thread to arrive runs last before all are released
+    class Barrier
+    {
+        mutex _mutex;
+        condition_variable _cv;
+        unsigned _n, _arrived = 0;
+        unsigned long _gen = 0;
+    public:
+        template<typename F> void wait(F last)
+        {
+            unique_lock<mutex> ulock(_mutex);
+            unsigned long gen = _gen;
+            if ( ++_arrived < _n )
+            {
+                _cv.wait(ulock, [&]{ return _gen != gen; });
+                return;
+            }
+            last();
+            _arrived = 0;
+            _gen++;
+            _cv.notify_all();
+        }
+        Barrier(unsigned n) : _n(n) {}
+    };
+
+    class LP
+    {
+        // A firing (_msg is NULL) or a received message run, with the start
+        // of its undo records and of the messages it sent
+        struct Event
+        {
+            Key _key;
+            Msg *_msg;
+            bool _quit;
+            size_t _undo, _sent;
+        };
+        // Token change of place _idx, or previous schedule of transition _idx
+        // (-1 if it wasn't scheduled)
+        struct Undo
+        {
+            bool _sched;
+            unsigned _idx;
+            double _v;
+        };
+        PNTimeWarp& _tw;
+        PNCompiledNet& _cn;
+        unsigned _k;
+        vector<unsigned> _tokens; // of the places owned
+        vector<unsigned> _enabledPlaceCnt;
+        PNIndexedHeap _tq;
+        map<pair<Key,unsigned long>,Msg*> _pending; // received, not run
+        unordered_map<unsigned long,Msg*> _received; // pending or run, by id
+        deque<Event> _done; // run and not committed, in order
+        deque<Undo> _undo;
+        deque<pair<unsigned,unsigned long>> _sent; // LP and id
+        size_t _undobase = 0, _sentbase = 0; // committed records dropped
+        vector<Msg*> _out; // by LP, of the firing being run
+        unsigned long _nextid = 0;
+        bool _idle = false, _ending = false;
+        Key _committed {0, 0};
+    public:
+        PNInbox<Msg*> _inbox;
+        PNTimeWarpStats _stats;
+        bool _more = false; // events after until, once run returns
+
+    private:
+        bool enabled(unsigned t) { return _enabledPlaceCnt[t] == _cn.ninputs(t); }
+        void sched(unsigned t, double time)
+        {
+            _undo.push_back({true, t, _tq.contains(t) ? _tq.key(t) : -1});
+            _tq.set(t, time);
+        }
+        // Firings schedule later ones only, else the stamp order of events
+        // wouldn't be the order STPetriNet fires them in
+        double scheduled(unsigned t, double now)
+        {
+            auto delay = _cn._transitions[t]->delay();
+            if ( delay == 0 )
+            {
+                cout << "PNTimeWarp : zero delay of transition " << _cn._transitions[t]->_name
+                     << ", delays must be positive" << endl;
+                exit(1);
+            }
+            return now + delay;
+        }
+        void unsched(unsigned t)
+        {
+            _undo.push_back({true, t, _tq.key(t)});
+            _tq.remove(t);
+        }
+        void deduct(unsigned p, unsigned tokens)
+        {
+            unsigned oldcnt = _tokens[p];
+            _tokens[p] -= tokens;
+            _undo.push_back({false, p, -(double) tokens});
+            _cn.forCrossedArcs(p, oldcnt-tokens, oldcnt, [&](unsigned i)
+            {
+                auto t = _cn._potrans[i];
+                if ( enabled(t) ) unsched(t);
+                _enabledPlaceCnt[t]--;
+            });
+        }
+        // Returns whether p is a quit place
+        bool add(unsigned p, unsigned newtokens, double now)
+        {
+            unsigned oldcnt = _tokens[p];
+            _tokens[p] += newtokens;
+            _undo.push_back({false, p, (double) newtokens});
+            _cn.forCrossedArcs(p, oldcnt, oldcnt+newtokens, [&](unsigned i) { _enabledPlaceCnt[_cn._potrans[i]]++; });
+            _cn.forCrossedArcs(p, oldcnt, oldcnt+newtokens, [&](unsigned i)
+            {
+                auto t = _cn._potrans[i];
+                if ( enabled(t) and not _tq.contains(t) ) sched(t, scheduled(t, now));
+            });
+            return _cn._isquit[p];
+        }
+        void revert(Undo& u)
+        {
+            if ( u._sched )
+            {
+                if ( u._v < 0 ) _tq.remove(u._idx);
+                else _tq.set(u._idx, u._v);
+                return;
+            }
+            unsigned p = u._idx, cur = _tokens[p], prev = cur - (long) u._v;
+            if ( u._v > 0 ) _cn.forCrossedArcs(p, prev, cur, [&](unsigned i) { _enabledPlaceCnt[_cn._potrans[i]]--; });
+            else _cn.forCrossedArcs(p, cur, prev, [&](unsigned i) { _enabledPlaceCnt[_cn._potrans[i]]++; });
+            _tokens[p] = prev;
+        }
+        void send(unsigned lp, Msg *msg)
+        {
+            msg->_id = ++_nextid * _tw._lps.size() + _k;
+            _sent.push_back({lp, msg->_id});
+            _stats._msgs++;
+            _tw._lps[lp]->_inbox.push(msg);
+        }
+        void sendAnti(unsigned lp, unsigned long id)
+        {
+            auto anti = new Msg();
+            anti->_anti = true;
+            anti->_id = id;
+            _stats._antimsgs++;
+            _tw._roundsent++;
+            _tw._lps[lp]->_inbox.push(anti);
+        }
+        void fire(unsigned t, double now, Event& ev)
+        {
+            for(unsigned i=_cn._tioff[t]; i<_cn._tioff[t+1]; i++)
+                deduct(_cn._tiplace[i], _cn._tiwt[i]);
+            for(unsigned i=_cn._tooff[t]; i<_cn._tooff[t+1]; i++)
+            {
+                unsigned p = _cn._toplace[i], lp = _tw._owner[p];
+                if ( lp == _k ) ev._quit = add(p, _cn._towt[i], now) or ev._quit;
+                else
+                {
+                    if ( _out[lp] == NULL )
+                    {
+                        _out[lp] = new Msg();
+                        _out[lp]->_key = ev._key;
+                    }
+                    _out[lp]->_deposits.push_back({p, _cn._towt[i]});
+                }
+            }
+            for(unsigned lp=0; lp<_out.size(); lp++)
+                if ( _out[lp] )
+                {
+                    send(lp, _out[lp]);
+                    _out[lp] = NULL;
+                }
+            if ( enabled(t) ) sched(t, scheduled(t, now));
+        }
+        // Of the next event to run, NEVER if none (by until)
+        Key nextKey(double until)
+        {
+            Key next {NEVER, 0};
+            if ( not _tq.empty() ) next = {_tq.topkey(), _tq.top()};
+            if ( not _pending.empty() and _pending.begin()->first.first < next ) next = _pending.begin()->first.first;
+            if ( next._time > until ) next._time = NEVER;
+            return next;
+        }
+        bool runNext()
+        {
+            Key next = nextKey(_tw._until);
+            if ( next._time == NEVER ) return false;
+            Event ev {next, NULL, false, _undobase + _undo.size(), _sentbase + _sent.size()};
+            if ( not _pending.empty() and _pending.begin()->first.first._t == next._t and
+                 _pending.begin()->first.first._time == next._time )
+            {
+                ev._msg = _pending.begin()->second;
+                _pending.erase(_pending.begin());
+                ev._msg->_processed = true;
+                for(auto& d:ev._msg->_deposits) ev._quit = add(d.first, d.second, next._time) or ev._quit;
+            }
+            else fire(next._t, next._time, ev);
+            _done.push_back(ev);
+            _stats._events++;
+            return true;
+        }
+        void undoLast()
+        {
+            auto& ev = _done.back();
+            while ( _undobase + _undo.size() > ev._undo )
+            {
+                revert(_undo.back());
+                _undo.pop_back();
+            }
+            while ( _sentbase + _sent.size() > ev._sent )
+            {
+                if ( not _ending ) sendAnti(_sent.back().first, _sent.back().second);
+                _sent.pop_back();
+            }
+            if ( ev._msg )
+            {
+                ev._msg->_processed = false;
+                _pending[{ev._msg->_key, ev._msg->_id}] = ev._msg;
+            }
+            _stats._rolledback++;
+            _done.pop_back();
+        }
+        void receive(Msg *msg)
+        {
+            if ( not msg->_anti )
+            {
+                if ( not _done.empty() and msg->_key < _done.back()._key )
+                {
+                    _stats._rollbacks++;
+                    while ( not _done.empty() and msg->_key < _done.back()._key ) undoLast();
+                }
+                _pending[{msg->_key, msg->_id}] = msg;
+                _received[msg->_id] = msg;
+                return;
+            }
+            auto it = _received.find(msg->_id);
+            auto orig = it->second;
+            if ( orig->_processed )
+            {
+                _stats._rollbacks++;
+                while ( orig->_processed ) undoLast();
+            }
+            _pending.erase({orig->_key, orig->_id});
+            _received.erase(it);
+            delete orig;
+            delete msg;
+        }
+        void drain() { _inbox.drain([&](Msg*& msg) { receive(msg); }); }
+        // Runs the actions of the events up to limit, drops their undo records
+        void commit(Key limit, bool inclusive)
+        {
+            while ( not _done.empty() and ( inclusive ? _done.front()._key <= limit : _done.front()._key < limit ) )
+            {
+                auto& ev = _done.front();
+                if ( ev._msg )
+                {
+                    _received.erase(ev._msg->_id);
+                    delete ev._msg;
+                }
+                else
+                {
+                    _tlnow = ev._key._time;
+                    _stats._firings++;
+                    _cn._transitions[ev._key._t]->enabledactions(0);
+                }
+                _committed = ev._key;
+                _done.pop_front();
+            }
+            size_t undo = _done.empty() ? _undobase + _undo.size() : _done.front()._undo;
+            size_t sent = _done.empty() ? _sentbase + _sent.size() : _done.front()._sent;
+            _undo.erase(_undo.begin(), _undo.begin() + ( undo - _undobase ));
+            _sent.erase(_sent.begin(), _sent.begin() + ( sent - _sentbase ));
+            _undobase = undo;
+            _sentbase = sent;
+        }
+        // Returns whether the run is over
+        bool round()
+        {
+            _tw._barrier.wait([&]{ _tw._roundsent = 0; });
+            // Rollbacks while receiving may send anti-messages, receive till
+            // a pass in which none was sent
+            do
+            {
+                drain();
+                _tw._barrier.wait([&]{ _tw._quiet = _tw._roundsent == 0; _tw._roundsent = 0; });
+            } while ( not _tw._quiet );
+            _tw._localmin[_k] = nextKey(_tw._until);
+            _tw._localquit[_k] = {NEVER, 0};
+            for(auto& ev:_done)
+                if ( ev._quit )
+                {
+                    _tw._localquit[_k] = ev._key;
+                    break;
+                }
+            _tw._barrier.wait([&]{ _tw.gvt(); });
+            commit(_tw._limit, _tw._quit);
+            return _tw._quit or _tw._limit._time == NEVER;
+        }
+        void setIdle(bool idle)
+        {
+            if ( idle == _idle ) return;
+            _idle = idle;
+            if ( idle ) _tw._nidle++;
+            else _tw._nidle--;
+        }
+    public:
+        Key committed() { return _committed; }
+        void run()
+        {
+            for(unsigned p=0; p<_cn.nplaces(); p++)
+                if ( _tw._owner[p] == _k and _tw._m0[p] ) add(p, _tw._m0[p], 0);
+            _undo.clear();
+            unsigned spins = 0;
+            while ( true )
+            {
+                drain();
+                if ( _tw._gvtreq.load(memory_order_relaxed) )
+                {
+                    if ( round() ) break;
+                    continue;
+                }
+                if ( _done.size() >= _tw._window )
+                {
+                    _tw._gvtreq = true;
+                    continue;
+                }
+                if ( runNext() )
+                {
+                    setIdle(false);
+                    spins = 0;
+                    continue;
+                }
+                // Nothing to run till a message comes, a round when all LPs
+                // are so, to find whether the net is dead
+                setIdle(true);
+                if ( _tw._nidle == _tw._lps.size() ) _tw._gvtreq = true;
+                else if ( ++spins < 64 ) this_thread::yield();
+                else this_thread::sleep_for(chrono::microseconds(50));
+            }
+            // Back to the state at the end of the run
+            _ending = true;
+            while ( not _done.empty() ) undoLast();
+            for(unsigned p=0; p<_cn.nplaces(); p++)
+                if ( _tw._owner[p] == _k ) _tw._marking[p] = _tokens[p];
+            _more = nextKey(NEVER)._time != NEVER;
+        }
+        LP(PNTimeWarp& tw, unsigned k) : _tw(tw), _cn(tw._cn), _k(k), _tokens(tw._cn.nplaces(), 0),
+            _enabledPlaceCnt(tw._cn.ntransitions(), 0), _out(tw.nthreads(), NULL)
+        {
+            _tq.resize(_cn.ntransitions());
+        }
+        ~LP()
+        {
+            for(auto& r:_received) delete r.second;
+            _inbox.drain([](Msg*& msg) { delete msg; });
+        }
+    };
+
+    PNCompiledNet& _cn;
+    vector<unsigned> _m0;
+    vector<unsigned> _lpof;  // of each transition
+    vector<unsigned> _owner; // LP of each place
+    vector<LP*> _lps;
+    double _until = NEVER;
+    size_t _window = 1024;
+    inline static thread_local double _tlnow = 0;
+    // GVT rounds
+    Barrier _barrier;
+    atomic<bool> _gvtreq {false};
+    atomic<unsigned> _nidle {0};
+    atomic<unsigned long> _roundsent {0};
+    bool _quiet = false, _quit = false;
+    vector<Key> _localmin, _localquit;
+    Key _limit {0, 0}; // committed up to
+    // Results
+    vector<unsigned> _marking;
+
+    // Called by the last LP arriving, the others wait
+    void gvt()
+    {
+        Key gvt {NEVER, 0}, quit {NEVER, 0};
+        for(unsigned k=0; k<_lps.size(); k++)
+        {
+            if ( _localmin[k] < gvt ) gvt = _localmin[k];
+            if ( _localquit[k] < quit ) quit = _localquit[k];
+        }
+        // A quit before GVT is sure to happen, the run ends with it
+        _quit = quit < gvt;
+        _limit = _quit ? quit : gvt;
+        _gvtreq = false;
+    }
+    void runTask(unsigned op, unsigned k) { _lps[k]->run(); }
+    void partition()
+    {
+        unsigned nlps = nthreads(), nt = _cn.ntransitions();
+        auto part = _cn.partition(nlps);
+        // Consumers of a place go together: union find, then each set goes
+        // to the LP most of its transitions were partitioned to
+        vector<unsigned> uf(nt);
+        for(unsigned t=0; t<nt; t++) uf[t] = t;
+        auto find = [&](unsigned t)
+        {
+            while ( uf[t] != t ) t = uf[t] = uf[uf[t]];
+            return t;
+        };
+        for(unsigned p=0; p<_cn.nplaces(); p++)
+            for(unsigned i=_cn._pooff[p]+1; i<_cn._pooff[p+1]; i++)
+                uf[find(_cn._potrans[i])] = find(_cn._potrans[_cn._pooff[p]]);
+        vector<unsigned> bysets(nt);
+        for(unsigned t=0; t<nt; t++) bysets[t] = t;
+        for(unsigned t=0; t<nt; t++) find(t);
+        stable_sort(bysets.begin(), bysets.end(), [&](unsigned l, unsigned r) { return uf[l] < uf[r]; });
+        _lpof.assign(nt, 0);
+        vector<unsigned> votes(nlps);
+        for(unsigned i=0, j; i<nt; i=j)
+        {
+            votes.assign(nlps, 0);
+            for(j=i; j<nt and uf[bysets[j]] == uf[bysets[i]]; j++) votes[part[bysets[j]]]++;
+            unsigned lp = max_element(votes.begin(), votes.end()) - votes.begin();
+            for(unsigned m=i; m<j; m++) _lpof[bysets[m]] = lp;
+        }
+        _owner.assign(_cn.nplaces(), 0);
+        for(unsigned p=0; p<_cn.nplaces(); p++)
+        {
+            if ( _cn._pooff[p] < _cn._pooff[p+1] ) _owner[p] = _lpof[_cn._potrans[_cn._pooff[p]]];
+            else if ( _cn._pioff[p] < _cn._pioff[p+1] ) _owner[p] = _lpof[_cn._pitrans[_cn._pioff[p]]];
+        }
+        cout << "PNTimeWarp : " << nlps << " logical processes, " << _cn.sharedPlaces(_lpof) << " of "
+             << _cn.nplaces() << " places shared" << endl;
+    }
+public:
+    // Time of the firing whose enabled actions are running
+    static double now() { return _tlnow; }
+    // Runs till the net is dead, a quit place gets a token or the next
+    // firing is after until
+    PNTimeWarpResult run(double until=NEVER)
+    {
+        _until = until;
+        partition();
+        unsigned nlps = nthreads();
+        _localmin.resize(nlps);
+        _localquit.resize(nlps);
+        _marking = _m0;
+        for(unsigned k=0; k<nlps; k++) _lps.push_back(new LP(*this, k));
+        auto start = chrono::steady_clock::now();
+        for(unsigned k=0; k<nlps; k++) addtask(0, k, k);
+        wait();
+        PNTimeWarpResult result;
+        result._secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        result._status = _quit ? PNTimeWarpResult::QUIT : PNTimeWarpResult::DEAD;
+        for(unsigned k=0; k<nlps; k++)
+        {
+            auto stats = _lps[k]->_stats;
+            stats._ntransitions = count(_lpof.begin(), _lpof.end(), k);
+            stats._nplaces = count(_owner.begin(), _owner.end(), k);
+            result._firings += stats._firings;
+            result._time = max(result._time, _lps[k]->committed()._time);
+            if ( _lps[k]->_more and not _quit ) result._status = PNTimeWarpResult::LIMIT;
+            result._lps.push_back(stats);
+            delete _lps[k];
+        }
+        _lps.clear();
+        result._marking = _marking;
+        return result;
+    }
+    // An LP holding this many events not committed yet asks for a GVT round
+    // and runs no more till then. Smaller windows bound the work lost to
+    // rollbacks, at the cost of more frequent rounds.
+    void setWindow(size_t events) { _window = events ? events : 1; }
+    // Runs start from the initial markings of places, unless given a marking
+    // (indexed by PNPlace::_idx) here
+    void setInitialMarking(vector<unsigned>& m0) { _m0 = m0; }
+    PNTimeWarp(PetriNetBase& pn) : _cn(pn.compiled()), _barrier(nthreads())
+    {
+        for(auto p:_cn._places) _m0.push_back(p->marking());
+    }
+    ~PNTimeWarp() { shutdown(); }
+};
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef _PNTRACE_H
+#define _PNTRACE_H
+
+// Columnar binary trace of a run, built from a PNDBG log (see pnlog.h and
+// tools/pntrace) and read by memory mapping it, so that it can be queried
+// without scanning or loading it.
+//
+// The trace holds two tables, each split into blocks of a fixed size in bytes:
+//
+// Firings : transition index, eseqno and timestamp of each firing in the
+//           order of firing.
+// Tokens  : place index, signed token delta and timestamp of each change of
+//           a token count. Each block begins with a snapshot of the marking
+//           before its first change.
+//
+// Columns of a block are stored one after the other and timestamps are
+// delta encoded (from the previous entry of the block). Every block header
+// holds the timestamp and the sequence number of its first entry, as blocks
+// are of fixed size, a binary search over these finds the block holding a
+// given sequence number or time. Places and transitions are indexed as in
+// PNCompiledNet, the node table gives their nodeids and names.
+//
+// File layout (native endianness): PNTraceHeader, node table (nodeid, name
+// length, name of each place and then each transition, padded to 8 bytes),
+// firing blocks, token blocks.
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+struct PNTraceHeader
+{
+    char _magic[8];
+    uint32_t _nplaces;
+    uint32_t _ntransitions;
+    uint32_t _fblocksize;   // entries per firing block
+    uint32_t _tblocksize;   // entries per token block
+    uint64_t _nfirings;
+    uint64_t _ntokenchanges;
+    uint64_t _nodesoff;     // byte offsets of the node table and the tables
+    uint64_t _firingsoff;
+    uint64_t _tokensoff;
+};
+
+struct PNTraceBlock
+{
+    uint64_t _basets;       // timestamp of the first entry
+    uint64_t _first;        // sequence number of the first entry
+    uint32_t _n;            // entries in use, a block may be cut short
+    uint32_t _pad;
+};
+
+struct PNTraceFiring
+{
+    unsigned _t;
+    uint64_t _eseqno;
+    uint64_t _ts;
+};
+
+// Layout of the blocks of a trace with given dimensions
+class PNTraceLayout
+{
+public:
+    uint32_t _nplaces, _fblocksize, _tblocksize;
+    static uint64_t align8(uint64_t n) { return (n + 7) / 8 * 8; }
+    // Firing block : header, eseqno[], transition[], tsdelta[]
+    uint64_t fblockbytes() { return sizeof(PNTraceBlock) + _fblocksize * 16; }
+    uint64_t *feseqno(char *b) { return (uint64_t*) (b + sizeof(PNTraceBlock)); }
+    uint32_t *ftrans(char *b) { return (uint32_t*) (feseqno(b) + _fblocksize); }
+    uint32_t *ftsdelta(char *b) { return ftrans(b) + _fblocksize; }
+    // Token block : header, marking[], place[], delta[], tsdelta[]
+    uint64_t tblockbytes() { return align8(sizeof(PNTraceBlock) + (_nplaces + 3 * (uint64_t)_tblocksize) * 4); }
+    uint32_t *tmarking(char *b) { return (uint32_t*) (b + sizeof(PNTraceBlock)); }
+    uint32_t *tplace(char *b) { return tmarking(b) + _nplaces; }
+    int32_t *tdelta(char *b) { return (int32_t*) (tplace(b) + _tblocksize); }
+    uint32_t *ttsdelta(char *b) { return (uint32_t*) (tdelta(b) + _tblocksize); }
+    PNTraceLayout(uint32_t nplaces, uint32_t fblocksize, uint32_t tblocksize) :
+        _nplaces(nplaces), _fblocksize(fblocksize), _tblocksize(tblocksize) {}
+};
+
+// Writes a trace from firings and token changes given in time order. Token
+// blocks go to a scratch file first and are appended on close.
+class PNTraceWriter
+{
+    string _tracefile;
+    ofstream _ofs, _tofs;
+    PNTraceHeader _hdr {};
+    PNTraceLayout _layout;
+    vector<char> _fblock, _tblock;
+    vector<uint32_t> _marking;
+    uint64_t _fprevts = 0, _tprevts = 0;
+
+    void flushFiring()
+    {
+        auto b = (PNTraceBlock*) _fblock.data();
+        if ( b->_n == 0 ) return;
+        _ofs.write(_fblock.data(), _fblock.size());
+        fill(_fblock.begin(), _fblock.end(), 0);
+    }
+    void flushTokens()
+    {
+        auto b = (PNTraceBlock*) _tblock.data();
+        if ( b->_n == 0 ) return;
+        _tofs.write(_tblock.data(), _tblock.size());
+        fill(_tblock.begin(), _tblock.end(), 0);
+    }
+public:
+    void fire(unsigned t, uint64_t eseqno, uint64_t ts)
+    {
+        auto b = (PNTraceBlock*) _fblock.data();
+        // Deltas are 32 bit, a longer gap starts a new block
+        if ( b->_n == _layout._fblocksize or ( b->_n and ts - _fprevts > UINT32_MAX ) ) flushFiring();
+        if ( b->_n == 0 )
+        {
+            b->_basets = ts;
+            b->_first = _hdr._nfirings;
+            _fprevts = ts;
+        }
+        _layout.feseqno(_fblock.data())[b->_n] = eseqno;
+        _layout.ftrans(_fblock.data())[b->_n] = t;
+        _layout.ftsdelta(_fblock.data())[b->_n] = ts - _fprevts;
+        _fprevts = ts;
+        b->_n++;
+        _hdr._nfirings++;
+    }
+    void tokens(unsigned p, int delta, uint64_t ts)
+    {
+        auto b = (PNTraceBlock*) _tblock.data();
+        if ( b->_n == _layout._tblocksize or ( b->_n and ts - _tprevts > UINT32_MAX ) ) flushTokens();
+        if ( b->_n == 0 )
+        {
+            b->_basets = ts;
+            b->_first = _hdr._ntokenchanges;
+            _tprevts = ts;
+            memcpy(_layout.tmarking(_tblock.data()), _marking.data(), _marking.size() * 4);
+        }
+        _layout.tplace(_tblock.data())[b->_n] = p;
+        _layout.tdelta(_tblock.data())[b->_n] = delta;
+        _layout.ttsdelta(_tblock.data())[b->_n] = ts - _tprevts;
+        _tprevts = ts;
+        _marking[p] += delta;
+        b->_n++;
+        _hdr._ntokenchanges++;
+    }
+    void close()
+    {
+        flushFiring();
+        flushTokens();
+        _tofs.close();
+        _hdr._tokensoff = _ofs.tellp();
+        ifstream tifs(_tracefile + ".tmp", ios::binary);
+        _ofs << tifs.rdbuf();
+        tifs.close();
+        remove((_tracefile + ".tmp").c_str());
+        _ofs.seekp(0);
+        _ofs.write((char*) &_hdr, sizeof(_hdr));
+        _ofs.close();
+    }
+    // nodes: (nodeid, name) of places followed by transitions
+    PNTraceWriter(string tracefile, vector<pair<unsigned,string>>& nodes, unsigned nplaces,
+        unsigned fblocksize = 4096, unsigned tblocksize = 4096) :
+        _tracefile(tracefile), _layout(nplaces, fblocksize, max(tblocksize, (nplaces + 1) / 2 * 2)),
+        _marking(nplaces, 0)
+    {
+        _ofs.open(tracefile, ios::binary);
+        _tofs.open(tracefile + ".tmp", ios::binary);
+        if ( not _ofs or not _tofs )
+        {
+            cout << "PNTraceWriter : can't write " << tracefile << endl;
+            exit(1);
+        }
+        memcpy(_hdr._magic, "PNTRC001", 8);
+        _hdr._nplaces = nplaces;
+        _hdr._ntransitions = nodes.size() - nplaces;
+        _hdr._fblocksize = _layout._fblocksize;
+        _hdr._tblocksize = _layout._tblocksize;
+        _hdr._nodesoff = sizeof(_hdr);
+        _ofs.write((char*) &_hdr, sizeof(_hdr));
+        for(auto& node:nodes)
+        {
+            uint32_t id = node.first, len = node.second.size();
+            _ofs.write((char*) &id, sizeof(id));
+            _ofs.write((char*) &len, sizeof(len));
+            _ofs.write(node.second.data(), len);
+        }
+        _ofs.write("\0\0\0\0\0\0\0", (8 - _ofs.tellp() % 8) % 8);
+        _hdr._firingsoff = _ofs.tellp();
+        _fblock.assign(_layout.fblockbytes(), 0);
+        _tblock.assign(_layout.tblockbytes(), 0);
+    }
+};
+
+// Read only, memory mapped view of a trace
+class PNTrace
+{
+    char *_base = NULL;
+    size_t _len = 0;
+    PNTraceHeader _hdr;
+    PNTraceLayout _layout {0,0,0};
+    uint64_t _nfblocks = 0, _ntblocks = 0;
+
+    char *fblock(uint64_t i) { return _base + _hdr._firingsoff + i * _layout.fblockbytes(); }
+    char *tblock(uint64_t i) { return _base + _hdr._tokensoff + i * _layout.tblockbytes(); }
+    PNTraceBlock *hdr(char *b) { return (PNTraceBlock*) b; }
+    // Index of the last block for which key(block) <= v, -1 if none
+    template<typename F> long lastBlockNotAfter(uint64_t nblocks, uint64_t v, F key)
+    {
+        long lo = 0, hi = (long) nblocks - 1, ret = -1;
+        while ( lo <= hi )
+        {
+            long mid = (lo + hi) / 2;
+            if ( key(mid) <= v )
+            {
+                ret = mid;
+                lo = mid + 1;
+            }
+            else hi = mid - 1;
+        }
+        return ret;
+    }
+public:
+    // (nodeid, name) of places and transitions by their index
+    vector<pair<unsigned,string>> _places, _transitions;
+    uint64_t nfirings() { return _hdr._nfirings; }
+    uint64_t ntokenchanges() { return _hdr._ntokenchanges; }
+    unsigned nplaces() { return _hdr._nplaces; }
+    unsigned ntransitions() { return _hdr._ntransitions; }
+    // Calls f on each firing from seqno from onwards (in the order of firing)
+    // till f returns false or the trace ends
+    template<typename F> void forFirings(uint64_t from, F f)
+    {
+        long bi = lastBlockNotAfter(_nfblocks, from, [&](long i) { return hdr(fblock(i))->_first; });
+        for(uint64_t i = max(bi, 0L); i < _nfblocks; i++)
+        {
+            char *b = fblock(i);
+            uint64_t ts = hdr(b)->_basets;
+            for(uint32_t k=0; k<hdr(b)->_n; k++)
+            {
+                ts += _layout.ftsdelta(b)[k];
+                if ( hdr(b)->_first + k < from ) continue;
+                if ( not f(hdr(b)->_first + k, PNTraceFiring {_layout.ftrans(b)[k], _layout.feseqno(b)[k], ts}) ) return;
+            }
+        }
+    }
+    PNTraceFiring firing(uint64_t seqno)
+    {
+        PNTraceFiring ret {UINT_MAX, 0, 0};
+        forFirings(seqno, [&](uint64_t, PNTraceFiring f) { ret = f; return false; });
+        return ret;
+    }
+    // Seqno of the first firing at or after time ts, nfirings() if none
+    uint64_t firingAt(uint64_t ts)
+    {
+        long bi = lastBlockNotAfter(_nfblocks, ts, [&](long i) { return hdr(fblock(i))->_basets; });
+        uint64_t ret = nfirings();
+        forFirings(bi < 0 ? 0 : hdr(fblock(bi))->_first, [&](uint64_t seqno, PNTraceFiring f)
+        {
+            if ( f._ts < ts ) return true;
+            ret = seqno;
+            return false;
+        });
+        return ret;
+    }
+    // Token counts of places (by index) after all changes till time ts
+    vector<unsigned> markingAt(uint64_t ts)
+    {
+        vector<unsigned> marking(nplaces(), 0);
+        long bi = lastBlockNotAfter(_ntblocks, ts, [&](long i) { return hdr(tblock(i))->_basets; });
+        if ( bi < 0 ) return marking;
+        char *b = tblock(bi);
+        memcpy(marking.data(), _layout.tmarking(b), nplaces() * 4);
+        uint64_t t = hdr(b)->_basets;
+        for(uint32_t k=0; k<hdr(b)->_n; k++)
+        {
+            t += _layout.ttsdelta(b)[k];
+            if ( t > ts ) break;
+            marking[_layout.tplace(b)[k]] += _layout.tdelta(b)[k];
+        }
+        return marking;
+    }
+    PNTrace(string tracefile)
+    {
+        int fd = ::open(tracefile.c_str(), O_RDONLY);
+        struct stat st;
+        if ( fd < 0 or fstat(fd, &st) != 0 )
+        {
+            cout << "PNTrace : can't open " << tracefile << endl;
+            exit(1);
+        }
+        _len = st.st_size;
+        _base = _len >= sizeof(_hdr) ? (char*) mmap(NULL, _len, PROT_READ, MAP_PRIVATE, fd, 0) : (char*) MAP_FAILED;
+        ::close(fd);
+        if ( _base == MAP_FAILED or memcmp(_base, "PNTRC001", 8) != 0 )
+        {
+            cout << "PNTrace : " << tracefile << " is not a petrisimu trace" << endl;
+            exit(1);
+        }
+        memcpy(&_hdr, _base, sizeof(_hdr));
+        _layout = PNTraceLayout(_hdr._nplaces, _hdr._fblocksize, _hdr._tblocksize);
+        _nfblocks = (_hdr._tokensoff - _hdr._firingsoff) / _layout.fblockbytes();
+        _ntblocks = (_len - _hdr._tokensoff) / _layout.tblockbytes();
+        char *p = _base + _hdr._nodesoff;
+        for(uint32_t i=0; i<_hdr._nplaces + _hdr._ntransitions; i++)
+        {
+            uint32_t id, len;
+            memcpy(&id, p, 4);
+            memcpy(&len, p+4, 4);
+            ( i < _hdr._nplaces ? _places : _transitions ).push_back({id, string(p+8, len)});
+            p += 8 + len;
+        }
+    }
+    ~PNTrace() { munmap(_base, _len); }
+};
+
+#endif
@@ -0,0 +1,46 @@
+using namespace std;
+
+#include <iostream>
+#include <string>
+#include <chrono>
+#include "pnimport.h"
+
+// Imports a net from PNML or from the json of printjson (see pnimport.h),
+// chosen by the file extension (.json is json, anything else PNML), and
+// prints its size. If an output file is given the net is written to it: as
+// json or PNML for a .json or .pnml file, as a net image (see
+// PetriNetBase::saveImage) otherwise, e.g. to load large nets quickly later.
+//
+//     pnimport model.pnml model.img
+
+void usage()
+{
+    cout << "Usage: pnimport <net.pnml|net.json> [<out.json|out.pnml|out image>]" << endl;
+    exit(1);
+}
+
+static bool endswith(const string& s, const string& suffix)
+{
+    return s.size() >= suffix.size() and s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if ( argc < 2 or argc > 3 ) usage();
+    string in = argv[1], out = argc > 2 ? argv[2] : "";
+
+    auto start = chrono::steady_clock::now();
+    MTPetriNet pn("system");
+    if ( endswith(in, ".json") ) importJson(pn, in);
+    else importPnml(pn, in);
+    auto& cn = pn.compiled(); // checks the arcs
+    auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "PN_IMPORT:" << in << ":places=" << cn.nplaces() << ":transitions=" << cn.ntransitions()
+         << ":arcs=" << cn._tiplace.size() + cn._toplace.size() << ":ms=" << ms << endl;
+
+    if ( out.empty() ) return 0;
+    if ( endswith(out, ".json") ) pn.printjson(out);
+    else if ( endswith(out, ".pnml") ) pn.printpnml(out);
+    else pn.saveImage(out);
+    return 0;
+}
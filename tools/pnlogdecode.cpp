@@ -0,0 +1,63 @@
+using namespace std;
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include "pnlog.h"
+
+// Decodes a binary log written with PNDBG (see pnlog.h) to the text format:
+//
+//     p:<nodeid>:+<tokens added>:<token count>:<place name>
+//     p:<nodeid>:-<tokens deducted>:<token count>:<place name>
+//     t:<nodeid>:<transition name>:<eseqno>
+//     wait:<nodeid>:<transition name>
+//
+// Records are ordered by timestamp, -t prefixes each line with it (ns since
+// the log was opened).
+
+void usage()
+{
+    cout << "Usage: pnlogdecode [-t] <logfile>" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    bool showts = false;
+    string logfile;
+    for(int i=1; i<argc; i++)
+    {
+        string arg = argv[i];
+        if ( arg == "-t" ) showts = true;
+        else if ( logfile.empty() ) logfile = arg;
+        else usage();
+    }
+    if ( logfile.empty() ) usage();
+
+    PNLogReader log(logfile);
+    map<uint32_t,string> names;
+    for(auto& node:log._nodes) names[node.first] = node.second;
+
+    log.forEachInOrder([&](PNLogRecord& r)
+    {
+        if ( showts ) cout << r._ts << ":";
+        auto id = to_string(r._nodeid);
+        auto& name = names[r._nodeid];
+        switch(r._typ)
+        {
+            case PNLogRecord::ADD :
+                cout << "p:" << id << ":+" << r._delta << ":" << r._tokens << ":" << name << "\n";
+                break;
+            case PNLogRecord::DEDUCT :
+                cout << "p:" << id << ":-" << r._delta << ":" << r._tokens << ":" << name << "\n";
+                break;
+            case PNLogRecord::WAIT :
+                cout << "wait:" << id << ":" << name << "\n";
+                break;
+            default :
+                cout << "t:" << id << ":" << name << ":" << r._seqno << "\n";
+        }
+    });
+    return 0;
+}
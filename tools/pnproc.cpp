@@ -0,0 +1,45 @@
+using namespace std;
+
+#include <iostream>
+#include <string>
+#include "pnimport.h"
+#include "pnproc.h"
+
+// Runs a net over NPROCS processes (see pnproc.h) and prints the throughput
+// and message rates of each partition. The net is a PNML or json file (see
+// pnimport.h), chosen by the extension, or a net image (see
+// PetriNetBase::saveImage) for any other extension.
+//
+//     NPROCS=8 pnproc model.img 100000000
+
+void usage()
+{
+    cout << "Usage: pnproc <net.pnml|net.json|net image> [maxfirings]" << endl;
+    exit(1);
+}
+
+static bool endswith(const string& s, const string& suffix)
+{
+    return s.size() >= suffix.size() and s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if ( argc < 2 or argc > 3 ) usage();
+    string in = argv[1];
+    unsigned long maxfirings = argc > 2 ? stoul(argv[2]) : ULONG_MAX;
+
+    // An image is run without building the net, see pnproc.h
+    if ( not endswith(in, ".json") and not endswith(in, ".pnml") )
+    {
+        PNProcSim sim(in);
+        sim.run(maxfirings).print(cout);
+        return 0;
+    }
+    STPetriNet pn("system");
+    if ( endswith(in, ".json") ) importJson(pn, in);
+    else importPnml(pn, in);
+    PNProcSim sim(pn);
+    sim.run(maxfirings).print(cout);
+    return 0;
+}
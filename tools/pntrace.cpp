@@ -0,0 +1,100 @@
+using namespace std;
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include "pnlog.h"
+#include "pntrace.h"
+
+// Builds and queries columnar traces (see pntrace.h)
+//
+//     pntrace convert <logfile> <tracefile>    trace from a PNDBG binary log
+//     pntrace info <tracefile>
+//     pntrace firings <tracefile> <seqno> [count]
+//     pntrace firingsat <tracefile> <time> [count]
+//     pntrace marking <tracefile> <time>
+//
+// Times are in ns since the log was opened. Firings are printed as
+// <seqno>:<time>:t:<nodeid>:<transition name>:<eseqno> and the marking as
+// p:<nodeid>:<token count>:<place name> lines for places holding tokens.
+
+void usage()
+{
+    cout << "Usage: pntrace convert <logfile> <tracefile>" << endl;
+    cout << "       pntrace info <tracefile>" << endl;
+    cout << "       pntrace firings <tracefile> <seqno> [count]" << endl;
+    cout << "       pntrace firingsat <tracefile> <time> [count]" << endl;
+    cout << "       pntrace marking <tracefile> <time>" << endl;
+    exit(1);
+}
+
+void convert(string logfile, string tracefile)
+{
+    PNLogReader log(logfile);
+    map<unsigned,unsigned> idx; // nodeid to place or transition index
+    for(unsigned i=0; i<log._nodes.size(); i++)
+        idx[log._nodes[i].first] = i < log._nplaces ? i : i - log._nplaces;
+    PNTraceWriter trace(tracefile, log._nodes, log._nplaces);
+    log.forEachInOrder([&](PNLogRecord& r)
+    {
+        switch(r._typ)
+        {
+            case PNLogRecord::ADD : trace.tokens(idx[r._nodeid], r._delta, r._ts); break;
+            case PNLogRecord::DEDUCT : trace.tokens(idx[r._nodeid], -(int)r._delta, r._ts); break;
+            case PNLogRecord::FIRE : trace.fire(idx[r._nodeid], r._seqno, r._ts); break;
+            default : break;
+        }
+    });
+    trace.close();
+}
+
+void printFirings(PNTrace& trace, uint64_t from, uint64_t count)
+{
+    trace.forFirings(from, [&](uint64_t seqno, PNTraceFiring f)
+    {
+        if ( seqno >= from + count ) return false;
+        auto& t = trace._transitions[f._t];
+        cout << seqno << ":" << f._ts << ":t:" << t.first << ":" << t.second << ":" << f._eseqno << "\n";
+        return true;
+    });
+}
+
+int main(int argc, char *argv[])
+{
+    if ( argc < 3 ) usage();
+    string cmd = argv[1], file = argv[2];
+    if ( cmd == "convert" and argc == 4 )
+    {
+        convert(file, argv[3]);
+        return 0;
+    }
+    PNTrace trace(file);
+    if ( cmd == "info" )
+    {
+        cout << "places:" << trace.nplaces() << endl;
+        cout << "transitions:" << trace.ntransitions() << endl;
+        cout << "firings:" << trace.nfirings() << endl;
+        cout << "tokenchanges:" << trace.ntokenchanges() << endl;
+        if ( trace.nfirings() )
+        {
+            cout << "firsttime:" << trace.firing(0)._ts << endl;
+            cout << "lasttime:" << trace.firing(trace.nfirings()-1)._ts << endl;
+        }
+    }
+    else if ( ( cmd == "firings" or cmd == "firingsat" ) and argc >= 4 )
+    {
+        uint64_t from = stoull(argv[3]);
+        if ( cmd == "firingsat" ) from = trace.firingAt(from);
+        printFirings(trace, from, argc > 4 ? stoull(argv[4]) : 1);
+    }
+    else if ( cmd == "marking" and argc == 4 )
+    {
+        auto marking = trace.markingAt(stoull(argv[3]));
+        for(unsigned p=0; p<marking.size(); p++)
+            if ( marking[p] )
+                cout << "p:" << trace._places[p].first << ":" << marking[p] << ":" << trace._places[p].second << "\n";
+    }
+    else usage();
+    return 0;
+}
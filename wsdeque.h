@@ -0,0 +1,108 @@
+#ifndef _WSDEQUE_H
+#define _WSDEQUE_H
+
+// Chase-Lev work stealing deque, with memory orderings as described in
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.
+// PPoPP 2013).
+//
+// The owner thread pushes and pops at the bottom (LIFO, cache friendly), any
+// other thread may steal from the top (FIFO). T must be trivially copyable and
+// fit in a std::atomic, typically a pointer.
+
+#include <atomic>
+#include <list>
+
+using namespace std;
+
+template<typename T> class WSDeque
+{
+    class Ring
+    {
+        long _mask;
+        atomic<T> *_buf;
+    public:
+        long size() { return _mask + 1; }
+        T get(long i) { return _buf[i & _mask].load(memory_order_relaxed); }
+        void put(long i, T v) { _buf[i & _mask].store(v, memory_order_relaxed); }
+        Ring* grow(long bottom, long top)
+        {
+            auto r = new Ring(size() << 1);
+            for(long i=top; i<bottom; i++) r->put(i, get(i));
+            return r;
+        }
+        Ring(long size) : _mask(size-1), _buf(new atomic<T>[size]) {}
+        ~Ring() { delete[] _buf; }
+    };
+    // top and bottom are written by different threads, keep them on separate
+    // cache lines
+    alignas(64) atomic<long> _top {0};
+    alignas(64) atomic<long> _bottom {0};
+    atomic<Ring*> _ring;
+    // A thief may still be reading from an older ring, hence rings replaced by
+    // grow are retired only when the deque is destroyed
+    list<Ring*> _retired;
+public:
+    // Owner only
+    void push(T v)
+    {
+        long b = _bottom.load(memory_order_relaxed);
+        long t = _top.load(memory_order_acquire);
+        Ring *r = _ring.load(memory_order_relaxed);
+        if ( b - t > r->size() - 1 )
+        {
+            _retired.push_back(r);
+            r = r->grow(b, t);
+            _ring.store(r, memory_order_release);
+        }
+        r->put(b, v);
+        atomic_thread_fence(memory_order_release);
+        _bottom.store(b+1, memory_order_relaxed);
+    }
+    // Owner only
+    bool pop(T& v)
+    {
+        long b = _bottom.load(memory_order_relaxed) - 1;
+        Ring *r = _ring.load(memory_order_relaxed);
+        _bottom.store(b, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        long t = _top.load(memory_order_relaxed);
+        if ( t > b )
+        {
+            _bottom.store(b+1, memory_order_relaxed);
+            return false;
+        }
+        v = r->get(b);
+        if ( t == b )
+        {
+            // Last element, race against thieves for it
+            bool won = _top.compare_exchange_strong(t, t+1, memory_order_seq_cst, memory_order_relaxed);
+            _bottom.store(b+1, memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+    // Any thread
+    bool steal(T& v)
+    {
+        long t = _top.load(memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        long b = _bottom.load(memory_order_acquire);
+        if ( t >= b ) return false;
+        Ring *r = _ring.load(memory_order_acquire);
+        v = r->get(t);
+        return _top.compare_exchange_strong(t, t+1, memory_order_seq_cst, memory_order_relaxed);
+    }
+    // Approximate when called by a non owner
+    bool empty()
+    {
+        return _bottom.load(memory_order_relaxed) <= _top.load(memory_order_relaxed);
+    }
+    WSDeque(long size=256) : _ring(new Ring(size)) {}
+    ~WSDeque()
+    {
+        delete _ring.load();
+        for(auto r:_retired) delete r;
+    }
+};
+
+#endif